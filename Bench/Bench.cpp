@@ -0,0 +1,197 @@
+#include "../Shared.hpp"
+#include "../Compress.hpp"
+#include "../Sanitize.hpp"
+
+#include <optional>
+#include <random>
+#include <vector>
+
+// Keep the optimizer from throwing away benchmark results
+inline volatile std::size_t sink = 0;
+
+// Run fn until at least min_duration has passed and return the throughput in GB/s
+template <typename Fn>
+double measure_gbps( std::size_t bytes_per_call, Fn&& fn ) {
+    constexpr static const auto min_duration = std::chrono::milliseconds( 500 );
+    using clock = std::chrono::steady_clock;
+
+    std::size_t calls = 0;
+    const auto start = clock::now( );
+    auto elapsed = clock::duration::zero( );
+    do {
+        for ( int i = 0; i < 64; ++i, ++calls )
+            fn( );
+        elapsed = clock::now( ) - start;
+    } while ( elapsed < min_duration );
+
+    const double seconds = std::chrono::duration<double>( elapsed ).count( );
+    return static_cast< double >( bytes_per_call * calls ) / seconds / 1e9;
+}
+
+// Build a payload of the given size by repeating pieces picked at random
+std::string make_payload( std::size_t size, const std::vector<std::string_view>& pieces ) {
+    std::mt19937 rng( 42 );
+    std::string payload = {};
+    while ( payload.size( ) < size )
+        payload.append( pieces[ rng( ) % pieces.size( ) ] );
+    payload.resize( size );
+    return payload;
+}
+
+void bench_sanitize( ) {
+#if defined( SANITIZE_SSE2 )
+    const std::string_view path = Sanitize::copy_safe_handles_utf8 ? "AVX2" : "SSE2";
+#else
+    const std::string_view path = Sanitize::copy_safe_handles_utf8 ? "AVX2" : "scalar";
+#endif
+    std::cout << std::format( "Sanitize::sanitize ({} path)", path ) << std::endl;
+
+    const std::vector<std::pair<std::string_view, std::vector<std::string_view>>> inputs = {
+        { "ascii", { "hello ", "world ", "how is everyone doing today? ", "lol ", "brb " } },
+        { "utf-8", { "hello ", "caf\xC3\xA9 ", "\xE2\x82\xAC" "5 ", "\xF0\x9F\x98\x80 ", "\xE3\x81\x93\xE3\x82\x93 " } },
+        { "hostile", { "hi ", "\x1B[31m", "\x1B]0;pwned\x07", "\xFF", "\xC2\x9B" "2J", "\t", "\xED\xA0\x80" } }
+    };
+
+    for ( const auto& [ name, pieces ] : inputs ) {
+        // One chat message sized payload and one large payload to show the bulk throughput
+        for ( const std::size_t size : { static_cast< std::size_t >( max_message_length ), std::size_t( 1 ) << 20 } ) {
+            const std::string payload = make_payload( size, pieces );
+            const double gbps = measure_gbps( payload.size( ), [ & ] {
+                sink = sink + Sanitize::sanitize( payload ).size( );
+            } );
+            std::cout << std::format( "  {:<8} {:>8} bytes  {:>7.2f} GB/s", name, size, gbps ) << std::endl;
+        }
+    }
+
+    // Plain copy of the same sized buffer for reference
+    const std::string payload( std::size_t( 1 ) << 20, 'a' );
+    const double gbps = measure_gbps( payload.size( ), [ & ] {
+        sink = sink + std::string( payload ).size( );
+    } );
+    std::cout << std::format( "  {:<8} {:>8} bytes  {:>7.2f} GB/s", "memcpy", payload.size( ), gbps ) << std::endl;
+}
+
+// Broadcast lines the way the server frames them, with a mix of short and long messages
+std::vector<std::string> make_broadcasts( std::size_t count ) {
+    const std::vector<std::string_view> words = {
+        "hey", "everyone", "what", "are", "you", "doing", "this", "weekend", "I", "think", "we", "should", "go", "to", "the",
+        "game", "tonight", "lol", "yeah", "sure", "thanks", "for", "help", "today", "did", "see", "that", "meeting", "got",
+        "moved", "tomorrow", "morning", "sounds", "good", "to", "me", "haha", "brb", "coffee", "deploy", "failed", "again" };
+    std::mt19937 rng( 42 );
+
+    std::vector<std::string> lines = {};
+    lines.reserve( count );
+    for ( std::size_t i = 0; i < count; ++i ) {
+        std::string message = {};
+        const std::size_t length = 2 + rng( ) % ( rng( ) % 8 == 0 ? 60 : 14 );
+        for ( std::size_t w = 0; w < length; ++w )
+            message.append( message.empty( ) ? "" : " " ).append( words[ rng( ) % words.size( ) ] );
+
+        // Every twentieth line is a presence delta instead of a message
+        const std::string body = i % 20 == 19 ? std::format( "{}1{}0{}+user{}", presence_flag, field_separator, field_separator, rng( ) % 500 )
+                                              : std::format( "[2026-10-18 12:{:02}:{:02}] user{}: {}", i / 60 % 60, i % 60, rng( ) % 500, message );
+        lines.push_back( std::format( "{}{}{}{}{}", sequence_flag, i + 1, field_separator, body, line_delimiter ) );
+    }
+    return lines;
+}
+
+// Nanoseconds per call of fn over all items, repeated until min_duration has passed
+template <typename Fn>
+double measure_ns_per_item( std::size_t items, Fn&& fn ) {
+    constexpr static const auto min_duration = std::chrono::milliseconds( 500 );
+    using clock = std::chrono::steady_clock;
+
+    std::size_t rounds = 0;
+    const auto start = clock::now( );
+    auto elapsed = clock::duration::zero( );
+    do {
+        fn( );
+        ++rounds;
+        elapsed = clock::now( ) - start;
+    } while ( elapsed < min_duration );
+
+    return static_cast< double >( std::chrono::duration_cast< std::chrono::nanoseconds >( elapsed ).count( ) ) / static_cast< double >( rounds * items );
+}
+
+void bench_compression( ) {
+    if ( !Compress::available( ) ) {
+        std::cout << "Compression (built without zlib, skipped)" << std::endl;
+        return;
+    }
+
+    constexpr static const std::size_t broadcasts = 10000;
+    constexpr static const std::size_t recipients = 100;
+    const std::vector<std::string> lines = make_broadcasts( broadcasts );
+    std::size_t plain_bytes = 0;
+    for ( const std::string& line : lines )
+        plain_bytes += line.size( );
+
+    std::cout << std::format( "Compression ({}, {} broadcasts to {} recipients each)", Compress::codec, broadcasts, recipients ) << std::endl;
+    // Compressing happens once per broadcast, inflating once per recipient on the client
+    const auto report = [ & ]( std::string_view name, std::size_t wire_bytes, std::optional<double> compress_ns, std::optional<double> inflate_ns ) {
+        const auto cost = [ ]( std::optional<double> ns ) { return ns.has_value( ) ? std::format( "{:.0f}", *ns ) : std::string( "-" ); };
+        std::cout << std::format( "  {:<14} {:>6.1f} B/msg {:>6.1f}%  egress {:>7.2f} MB  compress {:>6} ns/msg ({:>4} per recipient)  inflate {:>5} ns/msg",
+                                  name, static_cast< double >( wire_bytes ) / broadcasts, 100.0 * static_cast< double >( wire_bytes ) / static_cast< double >( plain_bytes ),
+                                  static_cast< double >( wire_bytes * recipients ) / 1e6, cost( compress_ns ),
+                                  cost( compress_ns.has_value( ) ? std::optional<double>( *compress_ns / recipients ) : std::nullopt ), cost( inflate_ns ) ) << std::endl;
+    };
+    report( "plain", plain_bytes, 0.0, 0.0 );
+
+    // What the server does: one frame per broadcast behind its uncompressed number, shared by every recipient,
+    // short lines stay plain
+    std::vector<std::string> frames( lines.size( ) );
+    const double frame_ns = measure_ns_per_item( lines.size( ), [ & ] {
+        for ( std::size_t i = 0; i < lines.size( ); ++i ) {
+            const std::size_t body = lines[ i ].find( field_separator ) + 1;
+            const std::optional<std::string> frame = Compress::frame( std::string_view( lines[ i ] ).substr( body ) );
+            frames[ i ] = frame.has_value( ) ? lines[ i ].substr( 0, body ).append( *frame ) : lines[ i ];
+        }
+    } );
+    std::size_t frame_bytes = 0;
+    for ( const std::string& frame : frames )
+        frame_bytes += frame.size( );
+
+    std::string inflated = {};
+    const double inflate_ns = measure_ns_per_item( lines.size( ), [ & ] {
+        for ( const std::string& frame : frames ) {
+            if ( const std::size_t start = frame.find( deflate_flag ); start != std::string::npos ) {
+                const std::size_t header = frame.find( line_delimiter, start ) + 1;
+                Compress::inflate( std::string_view( frame ).substr( header ), Compress::dictionary, inflated );
+                sink = sink + inflated.size( );
+            }
+        }
+    } );
+    report( "dictionary", frame_bytes, frame_ns, inflate_ns );
+
+    // The same without the shared dictionary, to show what it is worth on short messages
+    std::string compressed = {};
+    std::size_t bare_bytes = 0;
+    const double bare_ns = measure_ns_per_item( lines.size( ), [ & ] {
+        bare_bytes = 0;
+        for ( const std::string& line : lines ) {
+            Compress::deflate( line, {}, compressed );
+            bare_bytes += std::min( line.size( ), compressed.size( ) + deflate_flag.size( ) + 4 );
+        }
+    } );
+    report( "no dictionary", bare_bytes, bare_ns, std::nullopt );
+
+    // A resumed session gets the whole history in one frame
+    std::string history = {};
+    for ( const std::string& line : lines ) {
+        if ( history.size( ) + line.size( ) > 256 * 1024 )
+            break;
+        history.append( line );
+    }
+    std::string history_frame = {};
+    const double history_ns = measure_ns_per_item( 1, [ & ] {
+        history_frame = Compress::frame( history ).value_or( history );
+    } );
+    std::cout << std::format( "  {:<16} {:>7} B -> {:>6} B {:>6.1f}%  compress {:>7.0f} us", "history replay", history.size( ), history_frame.size( ),
+                              100.0 * static_cast< double >( history_frame.size( ) ) / static_cast< double >( history.size( ) ), history_ns / 1000 ) << std::endl;
+}
+
+int main( ) {
+    bench_sanitize( );
+    bench_compression( );
+    return 0;
+}
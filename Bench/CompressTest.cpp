@@ -0,0 +1,72 @@
+#include "../Shared.hpp"
+#include "../Compress.hpp"
+
+#include <random>
+
+// Round trips payloads through Compress::deflate/inflate and Compress::frame. Repetitive text compresses so
+// well that zlib can use up its input with output still pending, every such frame must still inflate.
+
+// Text built from a few pieces, repeated with some noise so it compresses anywhere from well to extremely well
+std::string make_text( std::mt19937& rng, std::size_t size ) {
+    constexpr static const std::string_view pieces[ ] = { "lol ", "haha ", "a", "aaaa", "[2026-01-01 00:00:00] user: ", "hello everyone ", "\n", "xyz" };
+    const std::size_t kinds = 1 + rng( ) % std::size( pieces );
+    const unsigned int noise = rng( ) % 4;
+
+    std::string text = {};
+    while ( text.size( ) < size ) {
+        text.append( pieces[ rng( ) % kinds ] );
+        if ( noise > 0 && rng( ) % ( 64u >> noise ) == 0 )
+            text.push_back( static_cast< char >( rng( ) ) );
+    }
+    text.resize( size );
+    return text;
+}
+
+int main( ) {
+    if ( !Compress::available( ) ) {
+        std::cout << "Built without zlib, nothing to test" << std::endl;
+        return 0;
+    }
+
+    bool passed = true;
+    const auto check = [ & ]( bool condition, std::string_view what ) {
+        std::cout << std::format( "{} {}", condition ? "ok  " : "FAIL", what ) << std::endl;
+        passed = passed && condition;
+    };
+
+    std::mt19937 rng( 42 );
+    std::string compressed = {}, inflated = {};
+
+    // Sizes from a single chat line up to the largest frame, weighted towards the short ones
+    std::size_t failures = 0;
+    for ( int i = 0; i < 20000; ++i ) {
+        const std::size_t size = i % 100 == 0 ? Compress::max_frame_length - rng( ) % 1024 : rng( ) % ( i % 10 == 0 ? 64 * 1024 : 2048 );
+        const std::string text = make_text( rng, size );
+        if ( !Compress::deflate( text, Compress::dictionary, compressed ) || !Compress::inflate( compressed, Compress::dictionary, inflated ) || inflated != text )
+            ++failures;
+    }
+    check( failures == 0, std::format( "deflate and inflate round trip ({} failures)", failures ) );
+
+    // Through frame() like the server, whatever comes out as a frame must inflate to the lines that went in
+    failures = 0;
+    for ( int i = 0; i < 40000; ++i ) {
+        std::string lines = make_text( rng, Compress::min_length + rng( ) % 2048 );
+        lines.push_back( line_delimiter );
+        const std::optional<std::string> frame = Compress::frame( lines );
+        if ( !frame.has_value( ) )
+            continue;
+        const std::size_t header = frame->find( line_delimiter ) + 1;
+        if ( !Compress::inflate( std::string_view( *frame ).substr( header ), Compress::dictionary, inflated ) || inflated != lines )
+            ++failures;
+    }
+    check( failures == 0, std::format( "frames inflate to their lines ({} failures)", failures ) );
+
+    // Corrupt and oversized frames are rejected rather than half inflated
+    const std::string text = make_text( rng, 4096 );
+    Compress::deflate( text, Compress::dictionary, compressed );
+    check( !Compress::inflate( std::string_view( compressed ).substr( 0, compressed.size( ) / 2 ), Compress::dictionary, inflated ), "truncated frame is rejected" );
+    Compress::deflate( std::string( Compress::max_frame_length + 1, 'a' ), Compress::dictionary, compressed );
+    check( !Compress::inflate( compressed, Compress::dictionary, inflated ), "frame inflating past max_frame_length is rejected" );
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+#include "../Shared.hpp"
+#include "../Sanitize.hpp"
+
+#include <random>
+
+// Runs the same input through the AVX2 path of Sanitize::sanitize and the SSE2 or scalar one, they must agree
+// byte for byte. Inputs mix valid UTF-8 with control characters, escape sequences and broken sequences, at
+// lengths and offsets that put them on either side of the 32 byte blocks.
+
+// Valid UTF-8 with every kind of character the sanitizer treats differently, then corrupted in a few places
+std::string make_text( std::mt19937& rng, std::size_t size ) {
+    // Characters that pass through first, so text built from the first few kinds is one long run
+    constexpr static const std::string_view pieces[ ] = {
+        "hello ", "\xC3\xA9", "a", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\xC2\xA0", "\xED\x9F\xBF", "\xEF\xBF\xBD", "\xF4\x8F\xBF\xBF",
+        "\t", "\x1B[31m", "\x1B]0;title\x07", "\x1B", "\x7F", "\r\n", "\xC2\x85", "\xC2\x9B" "1m" };
+    // Overlongs, surrogates, code points past U+10FFFF, stray continuations and bytes that never appear in UTF-8
+    constexpr static const std::string_view broken[ ] = {
+        "\xC0\x80", "\xC1\xBF", "\xE0\x80\x80", "\xED\xA0\x80", "\xF0\x80\x80\x80", "\xF4\x90\x80\x80", "\x80", "\xBF\xBF", "\xF5", "\xFF" };
+    const std::size_t kinds = 1 + rng( ) % std::size( pieces );
+
+    std::string text = {};
+    while ( text.size( ) < size )
+        text.append( pieces[ rng( ) % kinds ] );
+    // Cutting to size may split a sequence too
+    text.resize( size );
+
+    for ( unsigned int errors = rng( ) % 4; errors > 0 && !text.empty( ); --errors ) {
+        const std::size_t at = rng( ) % text.size( );
+        if ( rng( ) % 2 == 0 )
+            text[ at ] = static_cast< char >( rng( ) );
+        else
+            text.insert( at, broken[ rng( ) % std::size( broken ) ] );
+    }
+    return text;
+}
+
+int main( ) {
+    if ( !Sanitize::copy_safe_handles_utf8 ) {
+        std::cout << "No AVX2 on this CPU, nothing to compare" << std::endl;
+        return 0;
+    }
+
+    bool passed = true;
+    const auto check = [ & ]( bool condition, std::string_view what ) {
+        std::cout << std::format( "{} {}", condition ? "ok  " : "FAIL", what ) << std::endl;
+        passed = passed && condition;
+    };
+
+    std::mt19937 rng( 42 );
+
+    // Text that looks like chat, mostly short with some long enough for many blocks
+    std::size_t failures = 0, changed = 0;
+    for ( int i = 0; i < 200000; ++i ) {
+        const std::string text = make_text( rng, rng( ) % ( i % 10 == 0 ? 4096 : 160 ) );
+        const std::string sanitized = Sanitize::sanitize( text, true );
+        if ( sanitized != Sanitize::sanitize( text, false ) )
+            ++failures;
+        changed += sanitized != text ? 1 : 0;
+    }
+    check( failures == 0, std::format( "AVX2 and SSE2 paths agree on mixed UTF-8 ({} failures, {} inputs changed)", failures, changed ) );
+
+    // Uniformly random bytes, almost nothing in them is valid
+    failures = 0;
+    for ( int i = 0; i < 100000; ++i ) {
+        std::string text( rng( ) % 256, '\0' );
+        for ( char& c : text )
+            c = static_cast< char >( rng( ) );
+        if ( Sanitize::sanitize( text, true ) != Sanitize::sanitize( text, false ) )
+            ++failures;
+    }
+    check( failures == 0, std::format( "AVX2 and SSE2 paths agree on random bytes ({} failures)", failures ) );
+
+    // What comes out is safe already, so sanitizing it again must not change it on either path
+    failures = 0;
+    for ( int i = 0; i < 20000; ++i ) {
+        const std::string sanitized = Sanitize::sanitize( make_text( rng, rng( ) % 1024 ) );
+        if ( Sanitize::sanitize( sanitized, true ) != sanitized || Sanitize::sanitize( sanitized, false ) != sanitized )
+            ++failures;
+    }
+    check( failures == 0, std::format( "sanitized text is left alone ({} failures)", failures ) );
+
+    return passed ? 0 : 1;
+}
@@ -31,34 +31,487 @@ void read_user_input( std::string& buffer ) {
     std::cout << "\n";
 }
 
-void Client::read_messages( ) {
+// Print a message above the prompt and reprint the input typed so far
+void print_message( std::string_view message ) {
+    // Clear the enter message prompt line and print the message
+    std::cout << "\33[2K\r" << message << "\n";
+
+    // Reprint input
+    std::cout << enter_message << user_input_buffer << std::flush;
+}
+
+socket_t Client::connect_to_server( bool reconnecting ) {
+    for ( int attempt = 0; attempt < max_connect_attempts; ++attempt ) {
+        // Exponential backoff with full jitter so clients dropped at the same time do not all come back at once.
+        // A reconnect waits before its first attempt too, that is exactly when everyone would otherwise collide.
+        if ( attempt > 0 || reconnecting ) {
+            const int doublings = std::min( reconnecting ? attempt : attempt - 1, 16 );
+            const auto ceiling = std::min<std::chrono::milliseconds>( reconnect_max_delay, reconnect_base_delay * ( 1LL << doublings ) );
+            const auto delay = std::chrono::milliseconds( std::uniform_int_distribution<long long>( 0, ceiling.count( ) )( rng_ ) );
+
+            const std::string notice = attempt == 0 ? std::format( "Reconnecting in {} ms...", delay.count( ) ) : std::format( "Connection failed. Retrying in {} ms...", delay.count( ) );
+            if ( reconnecting )
+                print_message( notice );
+            else
+                std::cerr << notice << std::endl;
+            std::this_thread::sleep_for( delay );
+        }
+
+        // Create a socket and connect to the server
+        const socket_t connection = socket( AF_INET, SOCK_STREAM, 0 );
+        if ( connection == INVALID_SOCKET_VAL )
+            continue;
+        if ( connect( connection, reinterpret_cast< struct sockaddr* >( &server_addr_ ), sizeof( server_addr_ ) ) == 0 )
+            return connection;
+        CLOSESOCKET( connection );
+    }
+    return INVALID_SOCKET_VAL;
+}
+
+bool Client::reconnect( ) {
+    // Downloads can not continue on a new connection
+    for ( auto& [ id, download ] : downloads_ ) {
+        download.file.close( );
+        std::filesystem::remove( download.path );
+        print_message( std::format( "[{}] Download of {} from {} was interrupted", Shared::get_current_time( ), download.path.filename( ).string( ), download.from ) );
+    }
+    downloads_.clear( );
+    inbound_.clear( );
+    frame_remaining_ = 0;
+    compressed_.clear( );
+    compressed_remaining_ = 0;
+    compressed_stale_ = false;
+    presence_names_ = {};
+    roster_names_ = {};
+
+    const socket_t connection = connect_to_server( true );
+    if ( connection == INVALID_SOCKET_VAL )
+        return false;
+
+    // Swap the socket under the write lock so no line goes out half on the old and half on the new one
+    {
+        std::lock_guard<std::mutex> lock( write_mutex_ );
+        CLOSESOCKET( client_socket_ );
+        client_socket_ = connection;
+        ++connection_generation_;
+        pong_pending_ = false;
+    }
+
+    // Ask to resume the session so the server skips the login and sends what was missed,
+    // if the session is gone it logs in with the username instead
+    log_in( std::format( "{}{}{}{}{}{}", resume_flag, session_token_, field_separator, last_sequence_, field_separator, username_ ) );
+    return true;
+}
+
+bool Client::send_line( std::string_view text ) {
+    std::lock_guard<std::mutex> lock( write_mutex_ );
+    return Shared::send_line( client_socket_, text );
+}
+
+bool Client::log_in( std::string_view login ) {
+    // Ask for compressed broadcasts when they can be inflated, in the same write as the login itself
+    std::string lines = Compress::available( ) ? std::format( "{}{}{}", compress_flag, Compress::codec, line_delimiter ) : std::string( );
+    lines.append( login ).push_back( line_delimiter );
+
+    std::lock_guard<std::mutex> lock( write_mutex_ );
+    return Shared::send_all( client_socket_, lines );
+}
+
+bool Client::send_chat( std::string_view message ) {
+    // Messages longer than a line are split into chunks that the server puts back together
+    message = message.substr( 0, max_stream_length );
+    const std::size_t chunk_length = max_message_length - std::max( message_flag.size( ), chunk_flag.size( ) );
+
+    std::string lines = {};
+    lines.reserve( message.size( ) + ( message.size( ) / chunk_length + 1 ) * ( message_flag.size( ) + 1 ) );
+    while ( message.size( ) > chunk_length ) {
+        lines.append( chunk_flag ).append( message.substr( 0, chunk_length ) ).push_back( line_delimiter );
+        message.remove_prefix( chunk_length );
+    }
+    lines.append( message_flag ).append( message ).push_back( line_delimiter );
+
+	// Send the message to the server in one go so no file data frame ends up between the chunks
+    std::lock_guard<std::mutex> lock( write_mutex_ );
+    return Shared::send_all( client_socket_, lines );
+}
+
+void Client::handle_line( std::string_view line ) {
+    // Broadcasts are numbered so a resumed session only gets what it missed
+    if ( line.starts_with( sequence_flag ) ) {
+        line.remove_prefix( sequence_flag.size( ) );
+        const std::size_t separator = line.find( field_separator );
+        std::uint64_t sequence = 0;
+        if ( !Shared::parse_number( line.substr( 0, separator ), sequence ) )
+            return;
+        if ( sequence <= last_sequence_ ) {
+            // Already seen, but the bytes of a compressed broadcast still follow and have to be read past
+            if ( separator != std::string_view::npos && line.substr( separator + 1 ).starts_with( deflate_flag ) ) {
+                handle_line( line.substr( separator + 1 ) );
+                compressed_stale_ = true;
+            }
+            return;
+        }
+        last_sequence_ = sequence;
+
+        // Just the number for messages this client sent itself
+        if ( separator != std::string_view::npos )
+            handle_line( line.substr( separator + 1 ) );
+        return;
+    }
+
+    // The server confirmed the login, a different token means the old session could not be resumed
+    if ( line.starts_with( session_flag ) ) {
+        const std::string token( line.substr( session_flag.size( ) ) );
+        if ( !session_token_.empty( ) )
+            print_message( std::format( "[{}] Reconnected{}", Shared::get_current_time( ), token == session_token_ ? "" : " as a new session" ) );
+        if ( token != session_token_ )
+            last_sequence_ = 0;
+        session_token_ = token;
+        return;
+    }
+
+    // Answer heartbeats from the server without printing them
+    if ( line.starts_with( ping_flag ) ) {
+        // Never wait behind a file slice, the upload sends the pong once the slice is out.
+        // Whichever of the two sees the other one done sends it, if the upload finished meanwhile that is us.
+        std::unique_lock<std::mutex> lock( write_mutex_, std::defer_lock );
+        if ( uploading_ && !lock.try_lock( ) ) {
+            pong_pending_ = true;
+            if ( uploading_ || !pong_pending_.exchange( false ) )
+                return;
+        }
+        if ( !lock.owns_lock( ) )
+            lock.lock( );
+        if ( !Shared::send_line( client_socket_, pong_flag ) )
+            throw std::runtime_error( std::format( "Failed to send pong: {}", GET_ERROR ) );
+        return;
+    }
+
+    // Another user started sending a file, the header is the transfer id, size, sender and file name
+    if ( line.starts_with( file_flag ) ) {
+        const std::vector<std::string_view> fields = Shared::split_fields( line.substr( file_flag.size( ) ) );
+        std::uint64_t id = 0, size = 0;
+        if ( fields.size( ) != 4 || !Shared::parse_number( fields[ 0 ], id ) || !Shared::parse_number( fields[ 1 ], size ) )
+            return;
+
+        // Only keep the last path component and never overwrite an existing file
+        std::string name = Sanitize::sanitize( fields[ 3 ] );
+        std::replace( name.begin( ), name.end( ), '/', '_' );
+        std::replace( name.begin( ), name.end( ), '\\', '_' );
+        if ( name.empty( ) || name == "." || name == ".." )
+            name = std::format( "file_{}", id );
+
+        std::filesystem::create_directories( download_directory );
+        std::filesystem::path path = std::filesystem::path( download_directory ) / name;
+        for ( int copy = 1; std::filesystem::exists( path ); ++copy )
+            path = std::filesystem::path( download_directory ) / std::format( "{}_{}", copy, name );
+
+        Download download = {};
+        download.file.open( path, std::ios::binary );
+        download.path = path;
+        download.from = Sanitize::sanitize( fields[ 2 ] );
+        download.remaining = size;
+        print_message( std::format( "[{}] {} is sending you {} ({} bytes)", Shared::get_current_time( ), download.from, name, size ) );
+
+        // An empty file is complete right away
+        if ( size == 0 )
+            print_message( std::format( "[{}] Saved {}", Shared::get_current_time( ), path.string( ) ) );
+        else
+            downloads_.emplace( id, std::move( download ) );
+        return;
+    }
+
+    // The payload of this frame follows the line
+    if ( line.starts_with( data_flag ) ) {
+        const std::vector<std::string_view> fields = Shared::split_fields( line.substr( data_flag.size( ) ) );
+        if ( fields.size( ) != 2 || !Shared::parse_number( fields[ 0 ], frame_id_ ) || !Shared::parse_number( fields[ 1 ], frame_remaining_ ) )
+            throw std::runtime_error( "Invalid data frame" );
+        return;
+    }
+
+    // Broadcasts compressed by the server, the compressed bytes follow the line
+    if ( line.starts_with( deflate_flag ) ) {
+        if ( !Shared::parse_number( line.substr( deflate_flag.size( ) ), compressed_remaining_ ) || compressed_remaining_ == 0 || compressed_remaining_ > Compress::max_frame_length )
+            throw std::runtime_error( "Invalid compressed frame" );
+        compressed_.clear( );
+        return;
+    }
+
+    // The sender disconnected before the file was complete
+    if ( line.starts_with( cancel_flag ) ) {
+        std::uint64_t id = 0;
+        if ( !Shared::parse_number( line.substr( cancel_flag.size( ) ), id ) )
+            return;
+        if ( auto it = downloads_.find( id ); it != downloads_.end( ) ) {
+            it->second.file.close( );
+            std::filesystem::remove( it->second.path );
+            print_message( std::format( "[{}] {} cancelled sending {}", Shared::get_current_time( ), it->second.from, it->second.path.filename( ).string( ) ) );
+            downloads_.erase( it );
+        }
+        return;
+    }
+
+    // Users that joined or left since the last update
+    if ( line.starts_with( presence_flag ) ) {
+        print_presence( line.substr( presence_flag.size( ) ) );
+        return;
+    }
+
+    // Answer to the who command
+    if ( line.starts_with( roster_flag ) ) {
+        print_roster( line.substr( std::min( line.size( ), roster_flag.size( ) + 1 ) ) );
+        return;
+    }
+
+	// Print the received message without any control sequences
+    print_message( Sanitize::sanitize( line ) );
+}
+
+// Join names into a readable list, mentioning how many the server left out of a long list
+std::string format_names( const std::vector<std::string_view>& names, std::size_t total ) {
+    std::string list = {};
+    for ( const std::string_view name : names )
+        list.append( list.empty( ) ? "" : ", " ).append( Sanitize::sanitize( name ) );
+    if ( total > names.size( ) )
+        list.append( std::format( "{}and {} more", list.empty( ) ? "" : ", ", total - names.size( ) ) );
+    return list;
+}
+
+// Adds the names of one line to list, true once all total of them are there. A line with other counts starts a new list.
+bool collect_names( NameList& list, std::string_view counts, std::span<const std::string_view> names, std::size_t total ) {
+    if ( list.counts != counts ) {
+        list.counts = counts;
+        list.names.clear( );
+    }
+    list.names.insert( list.names.end( ), names.begin( ), names.end( ) );
+    return list.names.size( ) >= total;
+}
+
+void Client::print_presence( std::string_view line ) {
+    // The joined and left counts are followed by the names, prefixed with + or -
+    const std::vector<std::string_view> fields = Shared::split_fields( line );
+    std::size_t joined = 0, left = 0;
+    if ( fields.size( ) < 2 || !Shared::parse_number( fields[ 0 ], joined ) || !Shared::parse_number( fields[ 1 ], left ) )
+        return;
+
+    // Wait for the rest of a list that did not fit in one line
+    if ( !collect_names( presence_names_, std::format( "{} {}", joined, left ), std::span( fields ).subspan( 2 ), joined + left ) )
+        return;
+    const NameList list = std::exchange( presence_names_, { } );
+
+    std::vector<std::string_view> joined_names = {}, left_names = {};
+    for ( const std::string_view name : list.names ) {
+        if ( name.starts_with( '+' ) )
+            joined_names.push_back( name.substr( 1 ) );
+        else if ( name.starts_with( '-' ) )
+            left_names.push_back( name.substr( 1 ) );
+    }
+
+    std::string message = std::format( "[{}] Server:", Shared::get_current_time( ) );
+    if ( joined > 0 )
+        message.append( std::format( " {} joined ({})", joined, format_names( joined_names, joined ) ) );
+    if ( left > 0 )
+        message.append( std::format( "{} {} left ({})", joined > 0 ? "," : "", left, format_names( left_names, left ) ) );
+    print_message( message );
+}
+
+void Client::print_roster( std::string_view line ) {
+    // The number of users online followed by their names
+    const std::vector<std::string_view> fields = Shared::split_fields( line );
+    std::size_t online = 0;
+    if ( fields.empty( ) || !Shared::parse_number( fields[ 0 ], online ) )
+        return;
+
+    // Wait for the rest of a roster that did not fit in one line
+    if ( !collect_names( roster_names_, fields[ 0 ], std::span( fields ).subspan( 1 ), online ) )
+        return;
+    const NameList list = std::exchange( roster_names_, { } );
+
+    print_message( std::format( "[{}] Server: {} online ({})", Shared::get_current_time( ), online, format_names( { list.names.begin( ), list.names.end( ) }, online ) ) );
+}
+
+void Client::receive_payload( const char* data, std::size_t size ) {
+    // Payload of an unknown transfer is skipped
+    auto it = downloads_.find( frame_id_ );
+    if ( it == downloads_.end( ) )
+        return;
+
+    Download& download = it->second;
+    download.file.write( data, static_cast< std::streamsize >( std::min<std::uint64_t>( size, download.remaining ) ) );
+    download.remaining -= std::min<std::uint64_t>( size, download.remaining );
+
+    if ( download.remaining == 0 ) {
+        download.file.close( );
+        print_message( std::format( "[{}] Saved {} from {}", Shared::get_current_time( ), download.path.string( ), download.from ) );
+        downloads_.erase( it );
+    }
+}
+
+void Client::receive_compressed( ) {
+    if ( compressed_stale_ ) {
+        compressed_.clear( );
+        compressed_stale_ = false;
+        return;
+    }
+
+    std::string lines = {};
+    if ( !Compress::inflate( compressed_, Compress::dictionary, lines ) )
+        throw std::runtime_error( "Invalid compressed frame" );
+    compressed_.clear( );
+
+    // A frame only ever holds complete lines
+    std::string_view rest = lines;
+    for ( std::size_t delimiter = rest.find( line_delimiter ); delimiter != std::string_view::npos; delimiter = rest.find( line_delimiter ) ) {
+        handle_line( rest.substr( 0, delimiter ) );
+        rest.remove_prefix( delimiter + 1 );
+    }
+}
+
+void Client::upload_file( std::string recipient, std::filesystem::path path ) {
+    bool header_sent = false;
+    // The server drops a transfer with the connection, so give up if the client reconnects meanwhile
+    const std::uint64_t generation = connection_generation_;
     try {
-        while ( true ) {
-			// Wait for a message from the server
-			char message_buffer[ max_message_length + 1U ] = {};
-            const int bytes_received = Shared::receive_data( client_socket_, message_buffer );
-			// Check if the request was a HTTP request
-            if ( bytes_received == HTTP_DETECTED )
-                throw std::runtime_error( "HTTP request, ignoring" );
-
-			// Check if we received any data
-            if ( bytes_received <= 0 ) {
-                const int err = GET_ERROR;
-				// If the error is a non-blocking error or interrupted, just return
-                if ( bytes_received < 0 && ( err == WOULD_BLOCK || err == EINTR_ERR ) ) return;
-				// Throw an error indicating the server disconnected or a recv failure
-				throw std::runtime_error( bytes_received == 0 ? "Server disconnected" : std::format( "Message recv failed: {}", err ) );
+        const std::uint64_t size = std::filesystem::file_size( path );
+        if ( size > max_file_size )
+            throw std::runtime_error( "File is too large" );
+
+#ifdef _WIN32
+        std::ifstream file( path, std::ios::binary );
+        if ( !file )
+            throw std::runtime_error( "Could not open file" );
+        std::vector<char> slice( file_slice_length );
+#else
+        // Closed however the transfer ends, including every throw below
+        struct File {
+            int fd = -1;
+            ~File( ) {
+                if ( fd >= 0 )
+                    close( fd );
             }
+        } const file = { open( path.c_str( ), O_RDONLY | O_CLOEXEC ) };
+        if ( file.fd < 0 )
+            throw std::runtime_error( "Could not open file" );
+        off_t offset = 0;
+#endif
 
-			// Clear the enter message prompt line and print the received message
-            std::cout << "\33[2K\r" << message_buffer << "\n";
+        // Announce the file, the data frames follow right away
+        if ( !send_line( std::format( "{}{}{}{}{}{}", file_flag, size, field_separator, recipient, field_separator, path.filename( ).string( ) ) ) )
+            throw std::runtime_error( std::format( "Failed to send file header: {}", GET_ERROR ) );
+        header_sent = true;
+        print_message( std::format( "[{}] Sending {} ({} bytes) to {}", Shared::get_current_time( ), path.filename( ).string( ), size, recipient ) );
 
-            // Reprint input
-            std::cout << enter_message << user_input_buffer << std::flush;
+        std::uint64_t remaining = size;
+        while ( remaining > 0 ) {
+            const std::size_t length = static_cast< std::size_t >( std::min<std::uint64_t>( remaining, file_slice_length ) );
+
+            // One slice per lock so chat messages typed meanwhile go out between slices
+            std::lock_guard<std::mutex> lock( write_mutex_ );
+            if ( connection_generation_ != generation )
+                throw std::runtime_error( "Connection lost" );
+            if ( pong_pending_.exchange( false ) && !Shared::send_line( client_socket_, pong_flag ) )
+                throw std::runtime_error( std::format( "Failed to send pong: {}", GET_ERROR ) );
+            if ( !Shared::send_line( client_socket_, std::format( "{}{}", data_flag, length ) ) )
+                throw std::runtime_error( std::format( "Failed to send file: {}", GET_ERROR ) );
+
+#ifdef _WIN32
+            if ( !file.read( slice.data( ), static_cast< std::streamsize >( length ) ) ||
+                 !Shared::send_all( client_socket_, std::string_view( slice.data( ), length ) ) )
+                throw std::runtime_error( "Failed to send file" );
+#else
+            // Let the kernel copy straight from the page cache to the socket
+            for ( std::size_t sent = 0; sent < length; ) {
+                const ssize_t result = sendfile( client_socket_, file.fd, &offset, length - sent );
+                if ( result < 0 && GET_ERROR == EINTR_ERR )
+                    continue;
+                if ( result <= 0 )
+                    throw std::runtime_error( std::format( "Failed to send file: {}", GET_ERROR ) );
+                sent += static_cast< std::size_t >( result );
+            }
+#endif
+            remaining -= length;
         }
+
+        print_message( std::format( "[{}] Sent {} to {}", Shared::get_current_time( ), path.filename( ).string( ), recipient ) );
     }
     catch ( const std::exception& e ) {
-        std::cerr << std::format( "Exception: {}", e.what( ) ) << std::endl;
+        print_message( std::format( "Could not send {}: {}", path.string( ), e.what( ) ) );
+        // The server expects the rest of the file, the stream can not be recovered
+        std::lock_guard<std::mutex> lock( write_mutex_ );
+        if ( header_sent && connection_generation_ == generation )
+            shutdown( client_socket_, SD_BOTH );
+    }
+    uploading_ = false;
+
+    // A ping answered while the last slice went out
+    if ( pong_pending_.exchange( false ) )
+        send_line( pong_flag );
+}
+
+void Client::receive_messages( ) {
+    char receive_buffer[ file_slice_length ];
+    while ( true ) {
+        // Wait for data from the server
+        const int bytes_received = recv( client_socket_, receive_buffer, sizeof( receive_buffer ), 0 );
+
+        // Check if we received any data
+        if ( bytes_received <= 0 ) {
+            const int err = GET_ERROR;
+            // If the error is a non-blocking error or interrupted, just try again
+            if ( bytes_received < 0 && ( err == WOULD_BLOCK || err == EINTR_ERR ) ) continue;
+            // Throw an error indicating the server disconnected or a recv failure
+            throw std::runtime_error( bytes_received == 0 ? "Server disconnected" : std::format( "Message recv failed: {}", err ) );
+        }
+        inbound_.append( receive_buffer, static_cast< std::size_t >( bytes_received ) );
+
+        // Handle every complete line and data frame payload
+        std::size_t offset = 0;
+        while ( offset < inbound_.size( ) ) {
+            if ( frame_remaining_ > 0 ) {
+                const std::size_t length = static_cast< std::size_t >( std::min<std::uint64_t>( frame_remaining_, inbound_.size( ) - offset ) );
+                receive_payload( inbound_.data( ) + offset, length );
+                frame_remaining_ -= length;
+                offset += length;
+                continue;
+            }
+
+            if ( compressed_remaining_ > 0 ) {
+                const std::size_t length = static_cast< std::size_t >( std::min<std::uint64_t>( compressed_remaining_, inbound_.size( ) - offset ) );
+                compressed_.append( inbound_, offset, length );
+                compressed_remaining_ -= length;
+                offset += length;
+                if ( compressed_remaining_ == 0 )
+                    receive_compressed( );
+                continue;
+            }
+
+            const std::size_t delimiter = inbound_.find( line_delimiter, offset );
+            if ( delimiter == std::string::npos )
+                break;
+            handle_line( std::string_view( inbound_ ).substr( offset, delimiter - offset ) );
+            offset = delimiter + 1;
+        }
+        inbound_.erase( 0, offset );
+
+        // A line can hold at most a reassembled message plus its timestamp and username
+        if ( inbound_.size( ) > max_stream_length + max_message_length )
+            throw std::runtime_error( "Line too long" );
+    }
+}
+
+void Client::read_messages( ) {
+    while ( true ) {
+        try {
+            receive_messages( );
+        }
+        catch ( const std::exception& e ) {
+            print_message( std::format( "[{}] {}, reconnecting...", Shared::get_current_time( ), e.what( ) ) );
+        }
+
+        if ( !reconnect( ) ) {
+            print_message( "Could not reconnect to the server." );
+            return;
+        }
     }
 }
 
@@ -78,22 +531,40 @@ void Client::send_messages( ) {
                 continue;
             }
 
-            // Add message flag to the message
-            user_input_buffer.insert( 0, message_flag.data( ) );
-
-			// Ensure the message does not exceed the maximum length
-            const std::string safe_msg( user_input_buffer.c_str( ), std::min( static_cast<int>( user_input_buffer.size( ) ), max_message_length ) );
-
-			// Send the message to the server
-			if ( send( client_socket_, safe_msg.c_str( ), static_cast< int >( safe_msg.size( ) ), 0 ) < 0 ) {
-				throw std::runtime_error( std::format( "Failed to send message: {}", GET_ERROR ) );
-			}
-
             // Clear prompt line
             std::cout << "\33[A\33[2K\r";
 
-            // Remove message flag from the message
-            user_input_buffer.erase( 0, message_flag.size( ) );
+            // Ask the server who is online, the answer is printed when it arrives
+            if ( user_input_buffer == who_command ) {
+                if ( !send_line( roster_flag ) )
+                    std::cout << "Not connected, try again once reconnected." << std::endl;
+                user_input_buffer.clear( );
+                continue;
+            }
+
+            // Send a file in the background so chatting continues meanwhile
+            if ( user_input_buffer.starts_with( send_command ) ) {
+                const std::string arguments = user_input_buffer.substr( send_command.size( ) );
+                const std::size_t separator = arguments.find( ' ' );
+                if ( separator == std::string::npos )
+                    std::cout << "Usage: /send <username> <file>" << std::endl;
+                else if ( uploading_.exchange( true ) )
+                    std::cout << "A file is already being sent." << std::endl;
+                else {
+                    if ( upload_thread_.joinable( ) )
+                        upload_thread_.join( );
+                    upload_thread_ = std::jthread( &Client::upload_file, this, arguments.substr( 0, separator ), std::filesystem::path( arguments.substr( separator + 1 ) ) );
+                }
+                user_input_buffer.clear( );
+                continue;
+            }
+
+			// Send the message to the server, while reconnecting it is dropped instead of sent twice
+            if ( !send_chat( user_input_buffer ) ) {
+                std::cout << std::format( "[{}] Not connected, message was not sent: {}", Shared::get_current_time( ), user_input_buffer ) << std::endl;
+                user_input_buffer.clear( );
+                continue;
+            }
 
 			// Format and print the message with timestamp
             const std::string formatted = std::format( "[{}] You: {}", Shared::get_current_time( ), user_input_buffer );
@@ -112,8 +583,9 @@ void Client::run( const std::string& username ) {
 	// Print the username to the console
     std::cout << "Logged in as: " << username << std::endl;
 
-    // Send the username to the server
-	if ( send( client_socket_, username.c_str( ), static_cast< int >( username.size( ) ), 0 ) < 0 ) {
+    // Send the username to the server, kept to log in again if the session can not be resumed
+    username_ = username;
+	if ( !log_in( username ) ) {
 		throw std::runtime_error( std::format( "Failed to send username: {}", GET_ERROR ) );
 	}
 
@@ -124,6 +596,10 @@ void Client::run( const std::string& username ) {
 
 int main( ) {
     try {
+#ifndef _WIN32
+        // A server closing mid send must not kill the client
+        signal( SIGPIPE, SIG_IGN );
+#endif
 		std::string username = "";
         do {
             // Prompt the user for a username
@@ -140,7 +616,7 @@ int main( ) {
             }
 
             // set username to the user input buffer
-            username = std::string( user_input_buffer.c_str( ), std::min( static_cast< int >( user_input_buffer.size( ) ), max_username_length ) );
+            username = Sanitize::truncate( user_input_buffer, max_username_length );
 
             // Clear the input buffer for the next message
             user_input_buffer.clear( );
@@ -1,18 +1,86 @@
 #pragma once
 #include "../Shared.hpp"
+#include "../Compress.hpp"
+#include "../Sanitize.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <span>
+#include <unordered_map>
+#include <utility>
 
 #ifdef _WIN32
 #include <conio.h>
 #else
 #include <termios.h>
 #include <netdb.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #endif
 
 constexpr static const char* hostname = "hostname.com";
+// Received files are saved here
+constexpr static const char* download_directory = "downloads";
+// Command to send a file to another user
+constexpr static const std::string_view send_command = "/send ";
+// Command to list everyone online
+constexpr static const std::string_view who_command = "/who";
+// Longest wait before the first reconnect attempt, doubled after every failed attempt up to the maximum
+constexpr static const std::chrono::milliseconds reconnect_base_delay = std::chrono::milliseconds( 500 );
+constexpr static const std::chrono::milliseconds reconnect_max_delay = std::chrono::seconds( 30 );
+// Attempts before giving up on the server
+constexpr static const int max_connect_attempts = 10;
+
+// File being received from another user
+struct Download {
+    std::ofstream file = {};
+    std::filesystem::path path = {};
+    std::string from = {};
+    std::uint64_t remaining = 0;
+};
+
+// Names of a presence update or roster the server split over several lines, every line repeats the counts
+struct NameList {
+    std::string counts = {};
+    std::vector<std::string> names = {};
+};
 
 class Client {
 private:
     socket_t client_socket_ = {};
+    sockaddr_in server_addr_ = {};
+    // Keeps chat lines and file data frames from interleaving, also guards replacing client_socket_
+    std::mutex write_mutex_ = {};
+    // Bumped on every reconnect so a file transfer notices its connection is gone
+    std::atomic<std::uint64_t> connection_generation_ = 0;
+    // A pong the reading thread left to the upload, which holds the write lock while the server is slow to take a slice
+    std::atomic<bool> pong_pending_ = false;
+
+    // Login and resume state, only used by the reading thread once running
+    std::string username_ = {};
+    std::string session_token_ = {};
+    std::uint64_t last_sequence_ = 0;
+    std::mt19937 rng_{ std::random_device{ }( ) };
+
+    // Received bytes that have not been parsed yet
+    std::string inbound_ = {};
+    // Transfer and remaining payload of the data frame being received
+    std::uint64_t frame_id_ = 0;
+    std::uint64_t frame_remaining_ = 0;
+    // Compressed frame being received and the bytes still missing from it, a stale one is dropped instead of inflated
+    std::string compressed_ = {};
+    std::uint64_t compressed_remaining_ = 0;
+    bool compressed_stale_ = false;
+    std::unordered_map<std::uint64_t, Download> downloads_ = {};
+    // Names collected so far of a list that is still being received
+    NameList presence_names_ = {};
+    NameList roster_names_ = {};
+
+    std::atomic<bool> uploading_ = false;
+    std::jthread upload_thread_ = {};
 public:
     Client( ) {
 #ifdef _WIN32
@@ -33,18 +101,6 @@ public:
         term.c_lflag &= ~( ICANON | ECHO );
         tcsetattr( STDIN_FILENO, TCSANOW, &term );
 #endif
-        // Create a socket
-        client_socket_ = socket( AF_INET, SOCK_STREAM, 0 );
-		// Check if the socket was created successfully
-        if ( client_socket_ == INVALID_SOCKET_VAL ) {
-            // Cleanup and throw error
-#ifdef _WIN32
-            // Cleanup Winsock
-            WSACleanup( );
-#endif
-            throw std::runtime_error( "Could not create socket" );
-        }
-
         // Resolve hostname to IPv4 address
         addrinfo hints = {};
         hints.ai_family = AF_INET;
@@ -53,51 +109,42 @@ public:
         // Use getaddrinfo to resolve the hostname
         addrinfo* result = nullptr;
         if ( getaddrinfo( hostname, nullptr, &hints, &result ) != 0 || result == nullptr ) {
-            // Close the socket and clean up
-            CLOSESOCKET( client_socket_ );
+            // Clean up
 #ifdef _WIN32
             // Cleanup Winsock
             WSACleanup( );
 #endif
             // Free the address info
-            freeaddrinfo( result );
+            if ( result != nullptr )
+                freeaddrinfo( result );
             throw std::runtime_error( "Failed to resolve hostname" );
         }
 
         // Extract the first IPv4 address from the result
         sockaddr_in* sockaddr_ipv4 = reinterpret_cast< sockaddr_in* >( result->ai_addr );
-        sockaddr_in server_addr = {};
         // Copy the resolved address and port
-        server_addr.sin_addr = sockaddr_ipv4->sin_addr;
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons( port );
+        server_addr_.sin_addr = sockaddr_ipv4->sin_addr;
+        server_addr_.sin_family = AF_INET;
+        server_addr_.sin_port = htons( port );
 
         // Free the address info
         freeaddrinfo( result );
 
-        // Connect to the server
-        while ( connect( client_socket_, reinterpret_cast< struct sockaddr* >( &server_addr ), sizeof( server_addr ) ) < 0 ) {
-            // Handle connection failure
-            std::cerr << "Connection failed. Retrying in 3 seconds..." << std::endl;
-            std::this_thread::sleep_for( std::chrono::seconds( 3 ) );
-
-            // Check for connection attempts limit and clean up if exceeded
-            static int attempts = 0;
-            if ( ++attempts >= 5 ) {
-                // Close the socket and clean up
-                CLOSESOCKET( client_socket_ );
+        // Connect to the server, backing off between attempts
+        client_socket_ = connect_to_server( false );
+        if ( client_socket_ == INVALID_SOCKET_VAL ) {
 #ifdef _WIN32
-                // Cleanup Winsock
-                WSACleanup( );
+            // Cleanup Winsock
+            WSACleanup( );
 #endif
-                // Free the address info
-                freeaddrinfo( result );
-                throw std::runtime_error( "Could not connect to server" );
-            }
+            throw std::runtime_error( "Could not connect to server" );
         }
     }
 
     ~Client( ) {
+        // Finish a running file transfer
+        if ( upload_thread_.joinable( ) )
+            upload_thread_.join( );
         // Notify all threads to shut down
         Shared::end_mt( );
         // Shutdown the client socket
@@ -110,6 +157,18 @@ public:
 #endif
     }
 private:
+    socket_t connect_to_server( bool reconnecting );
+    bool reconnect( );
+    bool send_line( std::string_view text );
+    bool log_in( std::string_view login );
+    bool send_chat( std::string_view message );
+    void handle_line( std::string_view line );
+    void print_presence( std::string_view line );
+    void print_roster( std::string_view line );
+    void receive_payload( const char* data, std::size_t size );
+    void receive_compressed( );
+    void upload_file( std::string recipient, std::filesystem::path path );
+    void receive_messages( );
     void read_messages( );
     void send_messages( );
 public:
@@ -0,0 +1,171 @@
+#pragma once
+#include "Shared.hpp"
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+// zlib ships with every Linux and macOS install, on Windows it is used when its headers are on the include path.
+// Define COMPRESS_DISABLE to build without it, the server then never agrees to compress.
+#if __has_include( <zlib.h> ) && !defined( COMPRESS_DISABLE )
+#include <zlib.h>
+#define COMPRESS_ZLIB
+#ifdef _MSC_VER
+#pragma comment(lib, "zlib.lib")
+#endif
+#endif
+
+// Optional compression of the lines the server sends. Every frame is raw deflate on its own, primed with a
+// dictionary of common chat text, so there is no per connection state: a broadcast is compressed once and the
+// same bytes go to every client that asked for it. Frames hold one or more complete lines, delimiters included.
+// A broadcast is compressed before it is numbered, so its frame follows the sequence number on the same line.
+namespace Compress {
+    // Named in the handshake, a new dictionary needs a new name
+    constexpr static const std::string_view codec = "deflate-chat2";
+    // Lines shorter than this are sent as they are, the frame header would eat most of the gain
+    constexpr static const std::size_t min_length = 64;
+    // Largest frame before and after inflating, a resumed session replays at most history_bytes in one frame
+    constexpr static const std::size_t max_frame_length = 512 * 1024;
+    // zlib level, 6 is its default and within a few percent of 9 on short text
+    constexpr static const int level = 6;
+
+    // Primes every frame so even a single short message finds matches. zlib looks back from the end,
+    // so the most common strings come last.
+    constexpr static const std::string_view dictionary =
+        " because everyone something anything tomorrow tonight morning weekend meeting working thanks thank please sorry "
+        "really actually probably maybe pretty little though think would could should people today going doing about "
+        "there their where which right yeah okay sure nice cool haha lol :) :D ? ! "
+        "what when have that this with from just like know your they will been were them then than well good time "
+        "the and you for are not but can get how all out now one see who did need want back yes no ok hi hey "
+        "is sending you ( bytes) Transfer of finished dropped cancelled "
+        "Server: messages sent while you were away are no longer available\n"
+        " has joined the chat.\n Server: has disconnected.\n"
+        "[ PRESENCE ] 0\t1\t-[ PRESENCE ] 1\t0\t+"
+        "[2026-01-01 00:00:00] ";
+
+    inline bool available( ) {
+#ifdef COMPRESS_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    }
+
+#ifdef COMPRESS_ZLIB
+    // One deflate and one inflate stream per thread, reset for every frame instead of set up again
+    struct Deflater {
+        z_stream stream = {};
+        bool ready = false;
+
+        Deflater( ) {
+            // Negative window bits for raw deflate, the frame length already delimits the data. The full window
+            // keeps history replays small, memory level 4 shrinks the hash table cleared by every reset.
+            ready = deflateInit2( &stream, level, Z_DEFLATED, -15, 4, Z_DEFAULT_STRATEGY ) == Z_OK;
+        }
+
+        ~Deflater( ) {
+            if ( ready )
+                deflateEnd( &stream );
+        }
+    };
+
+    struct Inflater {
+        z_stream stream = {};
+        bool ready = false;
+
+        Inflater( ) {
+            ready = inflateInit2( &stream, -15 ) == Z_OK;
+        }
+
+        ~Inflater( ) {
+            if ( ready )
+                inflateEnd( &stream );
+        }
+    };
+#endif
+
+    // Raw deflate of input primed with dict into out, false if the codec is unavailable or failed
+    inline bool deflate( std::string_view input, std::string_view dict, std::string& out ) {
+#ifdef COMPRESS_ZLIB
+        thread_local Deflater deflater = {};
+        z_stream& stream = deflater.stream;
+        if ( !deflater.ready || deflateReset( &stream ) != Z_OK )
+            return false;
+        if ( !dict.empty( ) && deflateSetDictionary( &stream, reinterpret_cast< const Bytef* >( dict.data( ) ), static_cast< uInt >( dict.size( ) ) ) != Z_OK )
+            return false;
+
+        out.resize( deflateBound( &stream, static_cast< uLong >( input.size( ) ) ) );
+        stream.next_in = reinterpret_cast< Bytef* >( const_cast< char* >( input.data( ) ) );
+        stream.avail_in = static_cast< uInt >( input.size( ) );
+        stream.next_out = reinterpret_cast< Bytef* >( out.data( ) );
+        stream.avail_out = static_cast< uInt >( out.size( ) );
+        if ( ::deflate( &stream, Z_FINISH ) != Z_STREAM_END )
+            return false;
+        out.resize( stream.total_out );
+        return true;
+#else
+        ( void )input;
+        ( void )dict;
+        ( void )out;
+        return false;
+#endif
+    }
+
+    // Inverse of deflate, false on corrupt input or output longer than max_frame_length
+    inline bool inflate( std::string_view input, std::string_view dict, std::string& out ) {
+#ifdef COMPRESS_ZLIB
+        thread_local Inflater inflater = {};
+        z_stream& stream = inflater.stream;
+        if ( !inflater.ready || inflateReset( &stream ) != Z_OK )
+            return false;
+        // Raw streams take the dictionary up front instead of asking for it
+        if ( !dict.empty( ) && inflateSetDictionary( &stream, reinterpret_cast< const Bytef* >( dict.data( ) ), static_cast< uInt >( dict.size( ) ) ) != Z_OK )
+            return false;
+
+        out.clear( );
+        stream.next_in = reinterpret_cast< Bytef* >( const_cast< char* >( input.data( ) ) );
+        stream.avail_in = static_cast< uInt >( input.size( ) );
+        std::size_t used = 0;
+        while ( true ) {
+            // Grow the output as needed, chat text rarely shrinks below a quarter
+            out.resize( std::min( max_frame_length + 1, std::max<std::size_t>( used * 2, input.size( ) * 4 + 256 ) ) );
+            stream.next_out = reinterpret_cast< Bytef* >( out.data( ) + used );
+            stream.avail_out = static_cast< uInt >( out.size( ) - used );
+
+            const int result = ::inflate( &stream, Z_FINISH );
+            used = out.size( ) - stream.avail_out;
+            if ( result == Z_STREAM_END ) {
+                out.resize( used );
+                return used <= max_frame_length;
+            }
+            if ( ( result != Z_BUF_ERROR && result != Z_OK ) || used > max_frame_length )
+                return false;
+            // All input can be used up with output still pending, so only a full output buffer means there is more.
+            // Room left over without reaching the end means the frame was cut short.
+            if ( stream.avail_out > 0 )
+                return false;
+        }
+#else
+        ( void )input;
+        ( void )dict;
+        ( void )out;
+        return false;
+#endif
+    }
+
+    // Frame header and compressed bytes of lines, nothing if compressing is unavailable or would not save anything
+    inline std::optional<std::string> frame( std::string_view lines ) {
+        if ( lines.size( ) < min_length || lines.size( ) > max_frame_length )
+            return std::nullopt;
+
+        thread_local std::string compressed = {};
+        if ( !deflate( lines, dictionary, compressed ) )
+            return std::nullopt;
+
+        std::string framed = std::format( "{}{}{}", deflate_flag, compressed.size( ), line_delimiter );
+        if ( framed.size( ) + compressed.size( ) >= lines.size( ) )
+            return std::nullopt;
+        framed.append( compressed );
+        return framed;
+    }
+}
@@ -0,0 +1,45 @@
+#include "Replay.hpp"
+
+int main( int argc, char* argv[ ] ) {
+    try {
+        Options options = {};
+        bool valid = true;
+        for ( int i = 1; i < argc && valid; ++i ) {
+            const std::string_view arg = argv[ i ];
+            if ( arg == "--speed" && i + 1 < argc )
+                options.speed = std::stod( argv[ ++i ] );
+            else if ( arg == "--host" && i + 1 < argc )
+                options.host = argv[ ++i ];
+            else if ( arg == "--port" && i + 1 < argc )
+                options.port = std::stoi( argv[ ++i ] );
+            else if ( options.trace.empty( ) && !arg.starts_with( "--" ) )
+                options.trace = arg;
+            else
+                valid = false;
+        }
+        if ( !valid || options.trace.empty( ) || options.speed < 0 )
+            throw std::runtime_error( std::format( "Usage: {} <trace file> [--speed <multiplier, 0 for full speed>] [--host <ip>] [--port <port>]", argv[ 0 ] ) );
+
+#ifdef _WIN32
+        // Initialize Winsock
+        WSADATA wsaData = {};
+        if ( WSAStartup( MAKEWORD( 2, 2 ), &wsaData ) != 0 )
+            throw std::runtime_error( "WSAStartup failed" );
+#else
+        // A session the server dropped must not kill the replay
+        signal( SIGPIPE, SIG_IGN );
+#endif
+
+        Replay( std::move( options ) ).run( );
+
+#ifdef _WIN32
+        WSACleanup( );
+#endif
+    }
+    catch ( const std::exception& e ) {
+        std::cerr << "Exception: " << e.what( ) << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,435 @@
+#pragma once
+#include "../Shared.hpp"
+#include "../Trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
+// Put in front of every replayed message so its deliveries can be matched to the send
+constexpr static const std::string_view tag_prefix = "~r";
+// How long to keep reading after the last event for messages still in flight
+constexpr static const std::chrono::milliseconds drain_time = std::chrono::seconds( 2 );
+#ifdef _WIN32
+#define SD_SEND_ONLY SD_SEND
+#else
+#define SD_SEND_ONLY SHUT_WR
+#endif
+
+// Longest the reader blocks before it picks up new connections
+constexpr static const std::chrono::milliseconds poll_interval = std::chrono::milliseconds( 10 );
+
+struct Options {
+    std::string trace = {};
+    // Playback speed as a multiple of the recorded one, 0 sends everything as fast as possible
+    double speed = 1.0;
+    std::string host = "127.0.0.1";
+    int port = ::port;
+};
+
+// One simulated client
+struct Session {
+    socket_t socket = INVALID_SOCKET_VAL;
+    // Replayed lines and the pongs of the reader share the socket
+    std::mutex write_mutex = {};
+    // Set by the reader once the socket is closed, checked under write_mutex before every send
+    bool closed = false;
+
+    // Sender side, the first line of a connection is its username
+    bool logged_in = false;
+    // A chunked message was started so its tag was already sent
+    bool in_message = false;
+
+    // Reader side, inbound line that has not been completed yet and payload still to skip
+    std::string line = {};
+    std::uint64_t skip = 0;
+};
+
+// Plays a recorded trace back against a running server, one connection per recorded client,
+// and reports the throughput and the delivery latency of every tagged message
+class Replay {
+private:
+    using clock = std::chrono::steady_clock;
+
+    Options options_ = {};
+    std::vector<Trace::Event> events_ = {};
+
+    std::unordered_map<std::uint64_t, std::shared_ptr<Session>> sessions_ = {};
+    std::mutex sessions_mutex_ = {};
+
+    clock::time_point start_ = {};
+    // Send time of every tagged message in nanoseconds since start_, 0 until it is sent
+    std::vector<std::atomic<std::int64_t>> send_times_ = {};
+    std::atomic<bool> stopping_ = false;
+
+    // Sender statistics
+    std::uint64_t connections_ = 0;
+    std::uint64_t failed_connections_ = 0;
+    std::uint64_t lines_sent_ = 0;
+    std::uint64_t messages_sent_ = 0;
+    std::uint64_t bytes_sent_ = 0;
+    clock::duration max_lag_ = {};
+
+    // Reader statistics
+    std::uint64_t lines_received_ = 0;
+    std::uint64_t bytes_received_ = 0;
+    // Nanoseconds since start_ of the last receive, the end of the receiving window
+    std::int64_t last_receive_ = 0;
+    std::vector<std::int64_t> latencies_ = {};
+public:
+    explicit Replay( Options options ) : options_( std::move( options ) ) {
+        events_ = Trace::read( options_.trace );
+
+        // One send slot per message in the trace
+        const auto messages = std::count_if( events_.begin( ), events_.end( ), [ ]( const Trace::Event& event ) {
+            return event.kind == Trace::EventKind::Line && event.line.starts_with( message_flag );
+        } );
+        send_times_ = std::vector<std::atomic<std::int64_t>>( static_cast< std::size_t >( messages ) );
+    }
+
+    void run( );
+
+    // Messages seen by a receiver after they were sent, available once run returned
+    std::size_t delivered( ) const {
+        return latencies_.size( );
+    }
+private:
+    std::int64_t elapsed( ) const;
+    void open_session( std::uint64_t id );
+    void close_session( std::uint64_t id );
+    void send_line( std::uint64_t id, std::string_view line );
+    void send_data( std::uint64_t id, std::uint64_t length );
+    bool send_raw( Session& session, std::string_view data );
+    void read_loop( );
+    void receive( Session& session, const char* data, std::size_t size );
+    void handle_line( Session& session, std::string_view line );
+    void report( clock::duration duration ) const;
+};
+
+inline std::int64_t Replay::elapsed( ) const {
+    return std::chrono::duration_cast< std::chrono::nanoseconds >( clock::now( ) - start_ ).count( );
+}
+
+inline void Replay::run( ) {
+    if ( events_.empty( ) )
+        throw std::runtime_error( "Trace is empty" );
+
+    std::cout << std::format( "Replaying {} events at {} to {}:{}", events_.size( ),
+                              options_.speed > 0 ? std::format( "{}x", options_.speed ) : std::string( "full speed" ),
+                              options_.host, options_.port ) << std::endl;
+
+    start_ = clock::now( );
+    std::jthread reader( [ this ] { read_loop( ); } );
+
+    for ( const Trace::Event& event : events_ ) {
+        // Wait for the scaled time of the event, and track how far behind the schedule sending falls
+        if ( options_.speed > 0 ) {
+            const auto due = start_ + std::chrono::duration_cast< clock::duration >( std::chrono::duration<double, std::micro>( static_cast< double >( event.time ) / options_.speed ) );
+            const auto now = clock::now( );
+            if ( now < due )
+                std::this_thread::sleep_until( due );
+            else
+                max_lag_ = std::max( max_lag_, now - due );
+        }
+
+        switch ( event.kind ) {
+            case Trace::EventKind::Connect:
+                open_session( event.connection );
+                break;
+            case Trace::EventKind::Line:
+                send_line( event.connection, event.line );
+                break;
+            case Trace::EventKind::Data:
+                send_data( event.connection, event.length );
+                break;
+            case Trace::EventKind::Disconnect:
+                close_session( event.connection );
+                break;
+        }
+    }
+    const auto duration = clock::now( ) - start_;
+
+    // Give the server time to deliver what is still in flight
+    std::this_thread::sleep_for( drain_time );
+    stopping_ = true;
+    reader.join( );
+
+    // Close whatever the trace left connected
+    for ( auto& [ id, session ] : sessions_ ) {
+        if ( !session->closed )
+            CLOSESOCKET( session->socket );
+    }
+    sessions_.clear( );
+
+    report( duration );
+}
+
+inline void Replay::open_session( std::uint64_t id ) {
+    auto session = std::make_shared<Session>( );
+    session->socket = socket( AF_INET, SOCK_STREAM, 0 );
+
+    sockaddr_in server_addr = {};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons( static_cast< std::uint16_t >( options_.port ) );
+    if ( session->socket == INVALID_SOCKET_VAL || inet_pton( AF_INET, options_.host.c_str( ), &server_addr.sin_addr ) <= 0 ||
+#ifndef _WIN32
+         // select() can not watch descriptors past FD_SETSIZE
+         session->socket >= FD_SETSIZE ||
+#endif
+         connect( session->socket, reinterpret_cast< struct sockaddr* >( &server_addr ), sizeof( server_addr ) ) < 0 ) {
+        if ( session->socket != INVALID_SOCKET_VAL )
+            CLOSESOCKET( session->socket );
+        ++failed_connections_;
+        return;
+    }
+
+    // Sends wait for the socket to drain, receives only happen once select() reported data
+#ifdef _WIN32
+    u_long mode = 1;
+    ioctlsocket( session->socket, FIONBIO, &mode );
+#else
+    int flags = fcntl( session->socket, F_GETFL, 0 );
+    fcntl( session->socket, F_SETFL, flags | O_NONBLOCK );
+#endif
+
+    ++connections_;
+    std::lock_guard<std::mutex> lock( sessions_mutex_ );
+    sessions_[ id ] = std::move( session );
+}
+
+inline void Replay::close_session( std::uint64_t id ) {
+    std::shared_ptr<Session> session = {};
+    {
+        std::lock_guard<std::mutex> lock( sessions_mutex_ );
+        auto it = sessions_.find( id );
+        if ( it == sessions_.end( ) )
+            return;
+        session = it->second;
+    }
+
+    // Only stop sending, the server handles everything sent before and then closes the connection. The reader
+    // sees the end of the stream and closes the socket, so it is never closed under its select().
+    std::lock_guard<std::mutex> write_lock( session->write_mutex );
+    if ( !session->closed )
+        shutdown( session->socket, SD_SEND_ONLY );
+}
+
+inline void Replay::send_line( std::uint64_t id, std::string_view line ) {
+    std::shared_ptr<Session> session = {};
+    {
+        std::lock_guard<std::mutex> lock( sessions_mutex_ );
+        auto it = sessions_.find( id );
+        if ( it == sessions_.end( ) )
+            return;
+        session = it->second;
+    }
+
+    // Latency is matched on the plain text of a delivery, so sessions recorded from compressing clients
+    // do not ask for it. The server then sends them plain lines like any other client.
+    if ( line.starts_with( compress_flag ) )
+        return;
+
+    std::string text = {};
+    const bool is_message = line.starts_with( message_flag );
+    const bool is_chunk = line.starts_with( chunk_flag );
+    if ( session->logged_in && ( is_message || is_chunk ) && !session->in_message ) {
+        // Tag the first line of the message, trimming the end so the line still fits
+        const std::string_view flag = is_message ? message_flag : chunk_flag;
+        const std::size_t tag = static_cast< std::size_t >( messages_sent_++ );
+        text = std::format( "{}{}{} ", flag, tag_prefix, tag );
+        text.append( line.substr( flag.size( ), static_cast< std::size_t >( max_message_length ) - std::min<std::size_t>( text.size( ), max_message_length ) ) );
+        if ( tag < send_times_.size( ) )
+            send_times_[ tag ].store( std::max<std::int64_t>( 1, elapsed( ) ), std::memory_order_relaxed );
+    }
+    else
+        text = line;
+
+    session->logged_in = true;
+    if ( is_chunk )
+        session->in_message = true;
+    else if ( is_message )
+        session->in_message = false;
+
+    text.push_back( line_delimiter );
+    if ( send_raw( *session, text ) )
+        ++lines_sent_;
+}
+
+inline void Replay::send_data( std::uint64_t id, std::uint64_t length ) {
+    std::shared_ptr<Session> session = {};
+    {
+        std::lock_guard<std::mutex> lock( sessions_mutex_ );
+        auto it = sessions_.find( id );
+        if ( it == sessions_.end( ) )
+            return;
+        session = it->second;
+    }
+
+    // The contents of a file do not matter to the server, only its size
+    static const std::string zeros( file_slice_length, '\0' );
+    while ( length > 0 ) {
+        const std::size_t size = static_cast< std::size_t >( std::min<std::uint64_t>( length, zeros.size( ) ) );
+        if ( !send_raw( *session, std::string_view( zeros ).substr( 0, size ) ) )
+            return;
+        length -= size;
+    }
+}
+
+inline bool Replay::send_raw( Session& session, std::string_view data ) {
+    std::lock_guard<std::mutex> write_lock( session.write_mutex );
+    if ( session.closed || !Shared::send_all( session.socket, data ) )
+        return false;
+    bytes_sent_ += data.size( );
+    return true;
+}
+
+inline void Replay::read_loop( ) {
+    char buffer[ 16 * 1024 ] = {};
+    std::vector<std::pair<std::uint64_t, std::shared_ptr<Session>>> watched = {};
+
+    while ( !stopping_ ) {
+        // Watch every open session, the set changes as the trace connects and disconnects clients
+        fd_set read_set = {};
+        FD_ZERO( &read_set );
+        socket_t max_fd = 0;
+        watched.clear( );
+        {
+            std::lock_guard<std::mutex> lock( sessions_mutex_ );
+            for ( const auto& [ id, session ] : sessions_ ) {
+                FD_SET( session->socket, &read_set );
+                max_fd = std::max( max_fd, session->socket );
+                watched.emplace_back( id, session );
+            }
+        }
+
+        if ( watched.empty( ) ) {
+            std::this_thread::sleep_for( poll_interval );
+            continue;
+        }
+
+        timeval timeout = {};
+        timeout.tv_usec = static_cast< long >( std::chrono::duration_cast< std::chrono::microseconds >( poll_interval ).count( ) );
+        if ( select( static_cast< int >( max_fd ) + 1, &read_set, nullptr, nullptr, &timeout ) <= 0 )
+            continue;
+
+        for ( const auto& [ id, session ] : watched ) {
+            if ( !FD_ISSET( session->socket, &read_set ) )
+                continue;
+
+            const int received = recv( session->socket, buffer, sizeof( buffer ), 0 );
+            if ( received > 0 ) {
+                bytes_received_ += static_cast< std::uint64_t >( received );
+                last_receive_ = elapsed( );
+                receive( *session, buffer, static_cast< std::size_t >( received ) );
+                continue;
+            }
+            if ( received < 0 && ( GET_ERROR == WOULD_BLOCK || GET_ERROR == EINTR_ERR ) )
+                continue;
+
+            // Either side ended the connection, later events of this connection are skipped
+            {
+                std::lock_guard<std::mutex> write_lock( session->write_mutex );
+                session->closed = true;
+                CLOSESOCKET( session->socket );
+            }
+            std::lock_guard<std::mutex> lock( sessions_mutex_ );
+            if ( auto it = sessions_.find( id ); it != sessions_.end( ) && it->second == session )
+                sessions_.erase( it );
+        }
+    }
+}
+
+inline void Replay::receive( Session& session, const char* data, std::size_t size ) {
+    while ( size > 0 ) {
+        // Skip the payload of a file another session is sending to this one, or of a compressed frame
+        if ( session.skip > 0 ) {
+            const std::size_t skipped = static_cast< std::size_t >( std::min<std::uint64_t>( session.skip, size ) );
+            session.skip -= skipped;
+            data += skipped;
+            size -= skipped;
+            continue;
+        }
+
+        const char* delimiter = static_cast< const char* >( std::memchr( data, line_delimiter, size ) );
+        if ( delimiter == nullptr ) {
+            session.line.append( data, size );
+            return;
+        }
+
+        session.line.append( data, static_cast< std::size_t >( delimiter - data ) );
+        size -= static_cast< std::size_t >( delimiter - data ) + 1;
+        data = delimiter + 1;
+
+        handle_line( session, session.line );
+        session.line.clear( );
+    }
+}
+
+inline void Replay::handle_line( Session& session, std::string_view line ) {
+    ++lines_received_;
+
+    // Answer heartbeats so sessions stay connected however the trace is scaled
+    if ( line == ping_flag ) {
+        std::lock_guard<std::mutex> write_lock( session.write_mutex );
+        if ( !session.closed )
+            Shared::send_line( session.socket, pong_flag );
+        return;
+    }
+
+    // Header of a data frame, the payload follows
+    if ( line.starts_with( data_flag ) ) {
+        const std::vector<std::string_view> fields = Shared::split_fields( line.substr( data_flag.size( ) ) );
+        if ( fields.size( ) == 2 )
+            Shared::parse_number( fields[ 1 ], session.skip );
+        return;
+    }
+
+    // Compressed frame, only sent to clients that asked for it and behind its number for a broadcast.
+    // Skip it rather than read its bytes as lines.
+    std::string_view frame = line;
+    if ( frame.starts_with( sequence_flag ) && frame.find( field_separator ) != std::string_view::npos )
+        frame.remove_prefix( frame.find( field_separator ) + 1 );
+    if ( frame.starts_with( deflate_flag ) ) {
+        Shared::parse_number( frame.substr( deflate_flag.size( ) ), session.skip );
+        return;
+    }
+
+    // Match a delivered message to its send through the tag
+    const std::size_t position = line.find( tag_prefix );
+    if ( position == std::string_view::npos )
+        return;
+    line.remove_prefix( position + tag_prefix.size( ) );
+    std::size_t tag = 0;
+    if ( !Shared::parse_number( line.substr( 0, line.find( ' ' ) ), tag ) || tag >= send_times_.size( ) )
+        return;
+
+    const std::int64_t sent = send_times_[ tag ].load( std::memory_order_relaxed );
+    if ( sent != 0 )
+        latencies_.push_back( elapsed( ) - sent );
+}
+
+inline void Replay::report( clock::duration duration ) const {
+    const double seconds = std::max( 1e-9, std::chrono::duration<double>( duration ).count( ) );
+    // Deliveries keep arriving after the last send, most of all at full speed
+    const double receive_seconds = std::max( seconds, static_cast< double >( last_receive_ ) / 1e9 );
+    const auto to_ms = [ ]( std::int64_t ns ) { return static_cast< double >( ns ) / 1e6; };
+
+    std::cout << std::format( "Replayed {:.2f} s of traffic, {} connections ({} failed), max schedule lag {:.2f} ms",
+                              seconds, connections_, failed_connections_, to_ms( std::chrono::duration_cast< std::chrono::nanoseconds >( max_lag_ ).count( ) ) ) << std::endl;
+    std::cout << std::format( "  sent     {:>10} lines  {:>10} messages  {:>12} bytes  {:>10.0f} lines/s  {:>8.2f} MB/s",
+                              lines_sent_, messages_sent_, bytes_sent_, static_cast< double >( lines_sent_ ) / seconds, static_cast< double >( bytes_sent_ ) / seconds / 1e6 ) << std::endl;
+    std::cout << std::format( "  received {:>10} lines  {:>10} delivered {:>12} bytes  {:>10.0f} lines/s  {:>8.2f} MB/s",
+                              lines_received_, latencies_.size( ), bytes_received_, static_cast< double >( lines_received_ ) / receive_seconds, static_cast< double >( bytes_received_ ) / receive_seconds / 1e6 ) << std::endl;
+
+    if ( latencies_.empty( ) )
+        return;
+
+    std::vector<std::int64_t> sorted = latencies_;
+    std::sort( sorted.begin( ), sorted.end( ) );
+    const auto percentile = [ & ]( double p ) {
+        return to_ms( sorted[ std::min( sorted.size( ) - 1, static_cast< std::size_t >( p * static_cast< double >( sorted.size( ) ) ) ) ] );
+    };
+    std::cout << std::format( "  delivery latency  p50 {:.3f} ms  p90 {:.3f} ms  p99 {:.3f} ms  p99.9 {:.3f} ms  max {:.3f} ms",
+                              percentile( 0.5 ), percentile( 0.9 ), percentile( 0.99 ), percentile( 0.999 ), to_ms( sorted.back( ) ) ) << std::endl;
+}
@@ -0,0 +1,101 @@
+#include "Replay.hpp"
+
+#include <filesystem>
+
+// Replays a trace recorded from a client that asked for compression against a stand-in server on a free port.
+// The replay must not ask for compression itself, must skip a compressed frame it did not ask for, and must
+// still match the plain delivery of its message.
+
+// Bytes the stand-in server received, its single connection ends with the replay shutting down its side
+struct Received {
+    std::string text = {};
+    bool ok = false;
+};
+
+Received serve_once( socket_t listener ) {
+    Received received = {};
+    const socket_t client = accept( listener, nullptr, nullptr );
+    if ( client == INVALID_SOCKET_VAL )
+        return received;
+
+    char buffer[ 4096 ] = {};
+    int length = 0;
+    while ( ( length = recv( client, buffer, sizeof( buffer ), 0 ) ) > 0 )
+        received.text.append( buffer, static_cast< std::size_t >( length ) );
+
+    // Frames the replay never asked for, a resume frame and a numbered broadcast, with a tag and delimiters
+    // inside that must not be read as lines, then the plain delivery of the message
+    const std::string payload = "\n~r0 not a delivery\n\n";
+    std::string reply = std::format( "{}{}{}{}", deflate_flag, payload.size( ), line_delimiter, payload );
+    reply.append( std::format( "{}1{}{}{}{}{}", sequence_flag, field_separator, deflate_flag, payload.size( ), line_delimiter, payload ) );
+    reply.append( std::format( "{}2{}[2026-01-01 00:00:00] alice: ~r0 hello from a compressing client{}", sequence_flag, field_separator, line_delimiter ) );
+    received.ok = Shared::send_all( client, reply );
+
+    shutdown( client, SD_BOTH );
+    CLOSESOCKET( client );
+    return received;
+}
+
+int main( ) {
+#ifdef _WIN32
+    WSADATA wsaData = {};
+    if ( WSAStartup( MAKEWORD( 2, 2 ), &wsaData ) != 0 )
+        return 1;
+#else
+    signal( SIGPIPE, SIG_IGN );
+#endif
+
+    // Let the OS pick the port so the test never collides with a running server
+    const socket_t listener = socket( AF_INET, SOCK_STREAM, 0 );
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = 0;
+    inet_pton( AF_INET, "127.0.0.1", &address.sin_addr );
+    socklen_t address_length = sizeof( address );
+    if ( listener == INVALID_SOCKET_VAL || bind( listener, reinterpret_cast< sockaddr* >( &address ), sizeof( address ) ) != 0 ||
+         listen( listener, 1 ) != 0 || getsockname( listener, reinterpret_cast< sockaddr* >( &address ), &address_length ) != 0 ) {
+        std::cerr << "Could not listen: " << GET_ERROR << std::endl;
+        return 1;
+    }
+
+    // What a client built with zlib sends: the codec ahead of its username
+    const std::string path = ( std::filesystem::temp_directory_path( ) / "replay_test.trace" ).string( );
+    {
+        Trace::Writer writer( path );
+        writer.record( Trace::EventKind::Connect, 1 );
+        writer.record( Trace::EventKind::Line, 1, std::format( "{}deflate-chat2", compress_flag ) );
+        writer.record( Trace::EventKind::Line, 1, "alice" );
+        writer.record( Trace::EventKind::Line, 1, std::format( "{}hello from a compressing client", message_flag ) );
+        writer.record( Trace::EventKind::Disconnect, 1 );
+    }
+
+    Received received = {};
+    std::thread server( [ & ] { received = serve_once( listener ); } );
+
+    Options options = {};
+    options.trace = path;
+    options.speed = 0;
+    options.port = ntohs( address.sin_port );
+    Replay replay( options );
+    replay.run( );
+
+    server.join( );
+    CLOSESOCKET( listener );
+    std::filesystem::remove( path );
+
+    const std::string expected = std::format( "alice{}{}~r0 hello from a compressing client{}", line_delimiter, message_flag, line_delimiter );
+    bool passed = true;
+    const auto check = [ & ]( bool condition, std::string_view what ) {
+        std::cout << std::format( "{} {}", condition ? "ok  " : "FAIL", what ) << std::endl;
+        passed = passed && condition;
+    };
+    check( received.ok, "stand-in server sent its reply" );
+    check( received.text.find( compress_flag ) == std::string::npos, "replay does not ask for compression" );
+    check( received.text == expected, "replay sends the username and the tagged message" );
+    check( replay.delivered( ) == 1, "replay skips the compressed frames and matches the plain delivery" );
+
+#ifdef _WIN32
+    WSACleanup( );
+#endif
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,401 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// SSE2 is part of x86-64 so it is always available there. The AVX2 path is compiled into every x86 build and
+// picked at runtime on CPUs that support it, -mavx2 or /arch:AVX2 make it unconditional.
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define SANITIZE_SSE2
+#endif
+
+#if defined( __AVX2__ )
+#include <immintrin.h>
+#define SANITIZE_AVX2
+#define SANITIZE_AVX2_TARGET
+#elif ( defined( __x86_64__ ) || defined( __i386__ ) ) && ( defined( __GNUC__ ) || defined( __clang__ ) )
+// GCC and Clang only allow AVX2 intrinsics in functions marked for it
+#include <immintrin.h>
+#define SANITIZE_AVX2
+#define SANITIZE_AVX2_DISPATCH
+#define SANITIZE_AVX2_TARGET __attribute__( ( target( "avx2" ) ) )
+#elif defined( _M_X64 )
+// MSVC allows the intrinsics anywhere
+#include <immintrin.h>
+#define SANITIZE_AVX2
+#define SANITIZE_AVX2_DISPATCH
+#define SANITIZE_AVX2_TARGET
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Validates UTF-8 and strips terminal control characters and escape sequences from untrusted text
+// in a single pass. Runs that need no changes are found with SIMD and copied in bulk, only the bytes
+// around a problem go through the scalar decoder. On CPUs with AVX2 the vector path validates UTF-8 as well,
+// with plain SSE2 it only covers printable ASCII, which is most chat traffic.
+namespace Sanitize {
+    // Written in place of every byte that is not part of a valid UTF-8 sequence
+    constexpr static const std::string_view replacement_character = "\xEF\xBF\xBD";
+
+    // Index of the lowest set bit, mask must not be zero
+    inline int lowest_bit( std::uint32_t mask ) {
+#ifdef _MSC_VER
+        unsigned long index = 0;
+        _BitScanForward( &index, mask );
+        return static_cast< int >( index );
+#else
+        return __builtin_ctz( mask );
+#endif
+    }
+
+    // Bytes copy_safe may write past the end of the run it returns
+    constexpr static const std::size_t copy_slack = 32;
+
+#if defined( SANITIZE_AVX2 )
+    // Vectorized UTF-8 validation using the lookup algorithm from Keiser and Lemire,
+    // "Validating UTF-8 In Less Than One Instruction Per Byte" (2021)
+    namespace Avx2 {
+        constexpr static const std::uint8_t too_short = 1 << 0;
+        constexpr static const std::uint8_t too_long = 1 << 1;
+        constexpr static const std::uint8_t overlong_3 = 1 << 2;
+        constexpr static const std::uint8_t too_large = 1 << 3;
+        constexpr static const std::uint8_t surrogate = 1 << 4;
+        constexpr static const std::uint8_t overlong_2 = 1 << 5;
+        constexpr static const std::uint8_t too_large_1000 = 1 << 6;
+        constexpr static const std::uint8_t overlong_4 = 1 << 6;
+        constexpr static const std::uint8_t two_conts = 1 << 7;
+        constexpr static const std::uint8_t carry = too_short | too_long | two_conts;
+
+        // The same 16 entry table in both lanes, indexed by the low nibble of each byte
+        SANITIZE_AVX2_TARGET inline __m256i table( std::uint8_t t0, std::uint8_t t1, std::uint8_t t2, std::uint8_t t3,
+                              std::uint8_t t4, std::uint8_t t5, std::uint8_t t6, std::uint8_t t7,
+                              std::uint8_t t8, std::uint8_t t9, std::uint8_t t10, std::uint8_t t11,
+                              std::uint8_t t12, std::uint8_t t13, std::uint8_t t14, std::uint8_t t15 ) {
+            return _mm256_setr_epi8( t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15,
+                                     t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15 );
+        }
+
+        SANITIZE_AVX2_TARGET inline __m256i high_nibbles( __m256i v ) {
+            return _mm256_and_si256( _mm256_srli_epi16( v, 4 ), _mm256_set1_epi8( 0x0F ) );
+        }
+
+        // The input shifted right by N bytes with the tail of the previous block shifted in
+        template <int N>
+        SANITIZE_AVX2_TARGET inline __m256i previous( __m256i input, __m256i prev_input ) {
+            return _mm256_alignr_epi8( input, _mm256_permute2x128_si256( prev_input, input, 0x21 ), 16 - N );
+        }
+
+        // Non-zero in every byte that breaks UTF-8 or is a control character that must not be copied verbatim
+        SANITIZE_AVX2_TARGET inline __m256i unsafe_bytes( __m256i input, __m256i prev_input ) {
+            const __m256i prev1 = previous<1>( input, prev_input );
+
+            const __m256i byte_1_high = _mm256_shuffle_epi8( table(
+                too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+                two_conts, two_conts, two_conts, two_conts,
+                too_short | overlong_2,
+                too_short,
+                too_short | overlong_3 | surrogate,
+                too_short | too_large | too_large_1000 | overlong_4 ), high_nibbles( prev1 ) );
+            const __m256i byte_1_low = _mm256_shuffle_epi8( table(
+                carry | overlong_3 | overlong_2 | overlong_4,
+                carry | overlong_2,
+                carry,
+                carry,
+                carry | too_large,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000 | surrogate,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000 ), _mm256_and_si256( prev1, _mm256_set1_epi8( 0x0F ) ) );
+            const __m256i byte_2_high = _mm256_shuffle_epi8( table(
+                too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+                too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+                too_long | overlong_2 | two_conts | overlong_3 | too_large,
+                too_long | overlong_2 | two_conts | surrogate | too_large,
+                too_long | overlong_2 | two_conts | surrogate | too_large,
+                too_short, too_short, too_short, too_short ), high_nibbles( input ) );
+            const __m256i special_cases = _mm256_and_si256( _mm256_and_si256( byte_1_high, byte_1_low ), byte_2_high );
+
+            // Third and fourth bytes of a sequence have to be continuations
+            const __m256i is_third_byte = _mm256_subs_epu8( previous<2>( input, prev_input ), _mm256_set1_epi8( static_cast< char >( 0xE0 - 0x80 ) ) );
+            const __m256i is_fourth_byte = _mm256_subs_epu8( previous<3>( input, prev_input ), _mm256_set1_epi8( static_cast< char >( 0xF0 - 0x80 ) ) );
+            const __m256i must_be_continuation = _mm256_and_si256( _mm256_or_si256( is_third_byte, is_fourth_byte ), _mm256_set1_epi8( static_cast< char >( 0x80 ) ) );
+            const __m256i utf8_error = _mm256_xor_si256( must_be_continuation, special_cases );
+
+            // C0 controls and DEL
+            const __m256i control = _mm256_or_si256(
+                _mm256_and_si256( _mm256_cmpgt_epi8( input, _mm256_set1_epi8( -1 ) ), _mm256_cmpgt_epi8( _mm256_set1_epi8( 0x20 ), input ) ),
+                _mm256_cmpeq_epi8( input, _mm256_set1_epi8( 0x7F ) ) );
+            // C1 controls, encoded as 0xC2 0x80 - 0xC2 0x9F
+            const __m256i c1 = _mm256_and_si256(
+                _mm256_cmpeq_epi8( prev1, _mm256_set1_epi8( static_cast< char >( 0xC2 ) ) ),
+                _mm256_cmpeq_epi8( _mm256_min_epu8( input, _mm256_set1_epi8( static_cast< char >( 0x9F ) ) ), input ) );
+
+            return _mm256_or_si256( utf8_error, _mm256_or_si256( control, c1 ) );
+        }
+    }
+#endif
+
+    // Step back from the end of a validated run so it does not end in the middle of a UTF-8 sequence
+    inline std::size_t trim_partial_sequence( const unsigned char* data, std::size_t length ) {
+        std::size_t back = 0;
+        while ( back < 3 && back < length && ( data[ length - back - 1 ] & 0xC0 ) == 0x80 )
+            ++back;
+        if ( back < length && data[ length - back - 1 ] >= 0xC0 )
+            ++back;
+        return length - back;
+    }
+
+    // Whether the CPU running this process can take the AVX2 path
+    inline bool has_avx2( ) {
+#if defined( __AVX2__ )
+        return true;
+#elif defined( SANITIZE_AVX2_DISPATCH ) && defined( _MSC_VER )
+        // AVX2 is leaf 7 EBX bit 5, usable only if the OS saves the YMM registers (OSXSAVE and XCR0 bits 1 and 2)
+        int info[ 4 ] = {};
+        __cpuid( info, 1 );
+        if ( ( info[ 2 ] & ( 1 << 27 ) ) == 0 || ( _xgetbv( 0 ) & 6 ) != 6 )
+            return false;
+        __cpuidex( info, 7, 0 );
+        return ( info[ 1 ] & ( 1 << 5 ) ) != 0;
+#elif defined( SANITIZE_AVX2_DISPATCH )
+        // May run from a static initializer, before libgcc has filled in the CPU model
+        __builtin_cpu_init( );
+        return __builtin_cpu_supports( "avx2" );
+#else
+        return false;
+#endif
+    }
+
+    // Checked once at startup, sanitize passes it on to copy_safe for every run
+    inline const bool copy_safe_handles_utf8 = has_avx2( );
+
+    // Copy the printable ASCII (0x20 - 0x7E) run at data[ i ] onward to out and return where it ends
+    inline std::size_t copy_printable( const unsigned char* data, std::size_t size, char* out, std::size_t i ) {
+#if defined( SANITIZE_SSE2 )
+        const __m128i low_128 = _mm_set1_epi8( 0x1F );
+        const __m128i high_128 = _mm_set1_epi8( 0x7F );
+        for ( ; i + 16 <= size; i += 16 ) {
+            const __m128i block = _mm_loadu_si128( reinterpret_cast< const __m128i* >( data + i ) );
+            _mm_storeu_si128( reinterpret_cast< __m128i* >( out + i ), block );
+            const __m128i printable = _mm_and_si128( _mm_cmpgt_epi8( block, low_128 ), _mm_cmpgt_epi8( high_128, block ) );
+            const std::uint32_t mask = ~static_cast< std::uint32_t >( _mm_movemask_epi8( printable ) ) & 0xFFFFu;
+            if ( mask != 0 )
+                return i + lowest_bit( mask );
+        }
+#endif
+        // Scalar tail, or the whole input when no SIMD is available
+        for ( ; i < size; ++i ) {
+            if ( data[ i ] < 0x20 || data[ i ] > 0x7E )
+                return i;
+            out[ i ] = static_cast< char >( data[ i ] );
+        }
+        return size;
+    }
+
+#if defined( SANITIZE_AVX2 )
+    // Any valid UTF-8 without control characters, the part of the run after the last whole block is left to copy_printable
+    SANITIZE_AVX2_TARGET inline std::size_t copy_safe_avx2( const unsigned char* data, std::size_t size, char* out ) {
+        std::size_t i = 0;
+        // The run always starts on a character boundary so the previous block can be treated as ASCII
+        __m256i prev_input = _mm256_setzero_si256( );
+        for ( ; i + 32 <= size; i += 32 ) {
+            const __m256i input = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( data + i ) );
+            _mm256_storeu_si256( reinterpret_cast< __m256i* >( out + i ), input );
+
+            // Pure ASCII following pure ASCII only needs the printable check
+            if ( _mm256_movemask_epi8( _mm256_or_si256( input, prev_input ) ) == 0 ) {
+                const __m256i control = _mm256_or_si256( _mm256_cmpgt_epi8( _mm256_set1_epi8( 0x20 ), input ), _mm256_cmpeq_epi8( input, _mm256_set1_epi8( 0x7F ) ) );
+                const std::uint32_t mask = static_cast< std::uint32_t >( _mm256_movemask_epi8( control ) );
+                if ( mask != 0 )
+                    return i + lowest_bit( mask );
+                prev_input = input;
+                continue;
+            }
+
+            const __m256i unsafe = Avx2::unsafe_bytes( input, prev_input );
+            if ( !_mm256_testz_si256( unsafe, unsafe ) ) {
+                // Errors are flagged on the byte they are detected at, stop before the sequence it belongs to
+                const std::uint32_t mask = ~static_cast< std::uint32_t >( _mm256_movemask_epi8( _mm256_cmpeq_epi8( unsafe, _mm256_setzero_si256( ) ) ) );
+                return trim_partial_sequence( data, i + lowest_bit( mask ) );
+            }
+            prev_input = input;
+        }
+        // A sequence cut off by the last whole block is left to the scalar decoder
+        return copy_printable( data, size, out, trim_partial_sequence( data, i ) );
+    }
+#endif
+
+    // Copy the run at the start of data that needs no sanitizing to out and return its length. With AVX2 that is
+    // any valid UTF-8 without control characters, otherwise only printable ASCII (0x20 - 0x7E).
+    // Whole blocks are stored before they are checked, so out needs copy_slack bytes of room past the run.
+    inline std::size_t copy_safe( const unsigned char* data, std::size_t size, char* out, bool avx2 ) {
+#if defined( SANITIZE_AVX2 )
+        if ( avx2 )
+            return copy_safe_avx2( data, size, out );
+#endif
+        return copy_printable( data, size, out, 0 );
+    }
+
+    // Skip the body of an escape sequence, introducer is the byte following ESC (or the C1 code point minus 0x40)
+    // and pos points just past it. Returns the index of the first byte after the sequence.
+    inline std::size_t skip_sequence( const unsigned char* data, std::size_t size, unsigned char introducer, std::size_t pos ) {
+        switch ( introducer ) {
+            case '[': {
+                // CSI: parameter and intermediate bytes followed by one final byte
+                while ( pos < size && data[ pos ] >= 0x20 && data[ pos ] <= 0x3F )
+                    ++pos;
+                while ( pos < size && data[ pos ] >= 0x20 && data[ pos ] <= 0x2F )
+                    ++pos;
+                if ( pos < size && data[ pos ] >= 0x40 && data[ pos ] <= 0x7E )
+                    ++pos;
+                return pos;
+            }
+            case ']':
+            case 'P':
+            case 'X':
+            case '^':
+            case '_': {
+                // OSC, DCS, SOS, PM and APC: a string terminated by BEL or ST (ESC \ or C1 0x9C)
+                while ( pos < size ) {
+                    if ( data[ pos ] == 0x07 )
+                        return pos + 1;
+                    if ( data[ pos ] == 0x1B && pos + 1 < size && data[ pos + 1 ] == '\\' )
+                        return pos + 2;
+                    if ( data[ pos ] == 0xC2 && pos + 1 < size && data[ pos + 1 ] == 0x9C )
+                        return pos + 2;
+                    ++pos;
+                }
+                return size;
+            }
+            default:
+                if ( introducer >= 0x20 && introducer <= 0x2F ) {
+                    // nF: more intermediate bytes followed by one final byte
+                    while ( pos < size && data[ pos ] >= 0x20 && data[ pos ] <= 0x2F )
+                        ++pos;
+                    if ( pos < size && data[ pos ] >= 0x30 && data[ pos ] <= 0x7E )
+                        ++pos;
+                    return pos;
+                }
+                // Any other two byte sequence is complete already
+                return pos;
+        }
+    }
+
+    // Length of the valid UTF-8 sequence at the start of data, or 0 if it is invalid
+    inline std::size_t utf8_sequence_length( const unsigned char* data, std::size_t size ) {
+        const unsigned char lead = data[ 0 ];
+        std::size_t length = 0;
+        // Ranges allowed for the second byte, narrower for leads that could encode overlongs,
+        // surrogates or code points above U+10FFFF
+        unsigned char second_min = 0x80, second_max = 0xBF;
+
+        if ( lead >= 0xC2 && lead <= 0xDF ) length = 2;
+        else if ( lead >= 0xE0 && lead <= 0xEF ) {
+            length = 3;
+            if ( lead == 0xE0 ) second_min = 0xA0;
+            if ( lead == 0xED ) second_max = 0x9F;
+        }
+        else if ( lead >= 0xF0 && lead <= 0xF4 ) {
+            length = 4;
+            if ( lead == 0xF0 ) second_min = 0x90;
+            if ( lead == 0xF4 ) second_max = 0x8F;
+        }
+        else return 0;
+
+        if ( size < length || data[ 1 ] < second_min || data[ 1 ] > second_max )
+            return 0;
+        for ( std::size_t i = 2; i < length; ++i ) {
+            if ( ( data[ i ] & 0xC0 ) != 0x80 )
+                return 0;
+        }
+        return length;
+    }
+
+    // Return a copy of text that is valid UTF-8 and safe to print to a terminal. avx2 is only ever false
+    // to check the AVX2 path against the other one, it must not be true on a CPU without AVX2.
+    inline std::string sanitize( std::string_view text, bool avx2 = copy_safe_handles_utf8 ) {
+        const auto* data = reinterpret_cast< const unsigned char* >( text.data( ) );
+        const std::size_t size = text.size( );
+
+        // Valid bytes are copied one to one, so the output starts at the input size and only
+        // grows when replacement characters are written. Writes go through a raw pointer.
+        std::string result( size + copy_slack, '\0' );
+        char* out = result.data( );
+
+        std::size_t i = 0;
+        while ( i < size ) {
+            const unsigned char c = data[ i ];
+            if ( ( c >= 0x20 && c <= 0x7E ) || ( avx2 && c >= 0x80 ) ) {
+                // Copy the run that needs no sanitizing in one go
+                if ( const std::size_t run = copy_safe( data + i, size - i, out, avx2 ); run != 0 ) {
+                    out += run;
+                    i += run;
+                    continue;
+                }
+            }
+
+            if ( c == 0x1B ) {
+                // ESC starts a sequence, an ESC not followed by one is simply dropped
+                if ( i + 1 < size && data[ i + 1 ] >= 0x20 && data[ i + 1 ] <= 0x7E )
+                    i = skip_sequence( data, size, data[ i + 1 ], i + 2 );
+                else
+                    ++i;
+            }
+            else if ( c < 0x80 ) {
+                // Remaining C0 controls and DEL, tabs become spaces so words stay apart
+                if ( c == '\t' )
+                    *out++ = ' ';
+                ++i;
+            }
+            else if ( const std::size_t length = utf8_sequence_length( data + i, size - i ); length == 0 ) {
+                // Invalid or truncated sequence, make room for the rest of the input after the longer replacement
+                const std::size_t written = static_cast< std::size_t >( out - result.data( ) );
+                const std::size_t needed = written + replacement_character.size( ) + ( size - i - 1 ) + copy_slack;
+                if ( needed > result.size( ) ) {
+                    result.resize( std::max( needed, result.size( ) * 2 ) );
+                    out = result.data( ) + written;
+                }
+
+                for ( const char r : replacement_character )
+                    *out++ = r;
+                ++i;
+            }
+            else if ( c == 0xC2 && data[ i + 1 ] <= 0x9F ) {
+                // C1 controls (U+0080 - U+009F) behave like ESC followed by code point - 0x40
+                i = skip_sequence( data, size, static_cast< unsigned char >( data[ i + 1 ] - 0x40 ), i + 2 );
+            }
+            else {
+                // Valid sequences are at most four bytes, not worth a memcpy call
+                for ( std::size_t end = i + length; i < end; ++i )
+                    *out++ = static_cast< char >( data[ i ] );
+            }
+        }
+
+        result.resize( static_cast< std::size_t >( out - result.data( ) ) );
+        return result;
+    }
+
+    // Cut valid UTF-8 to at most max_length bytes without splitting a character, sanitize first
+    inline std::string truncate( std::string text, std::size_t max_length ) {
+        if ( text.size( ) <= max_length )
+            return text;
+        // Back up from the first dropped byte to the start of its character
+        std::size_t length = max_length;
+        while ( length > 0 && ( static_cast< unsigned char >( text[ length ] ) & 0xC0 ) == 0x80 )
+            --length;
+        text.resize( length );
+        return text;
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "../Shared.hpp"
+
+#include <deque>
+#include <memory>
+#include <string>
+
+// A receiver with more than this waiting for it can not keep up and is dropped
+constexpr static const std::size_t max_outbox_bytes = 4 * 1024 * 1024;
+
+// Everything waiting to be sent to one connection. Sending never blocks, whatever the socket does not take
+// stays queued until the socket is writable again. Entries are shared so a broadcast is built once and
+// queued for every receiver.
+class Outbox {
+private:
+    std::deque<std::shared_ptr<const std::string>> queue_ = {};
+    // Part of the front entry that was already sent
+    std::size_t offset_ = 0;
+    // Bytes still to send over all entries
+    std::size_t bytes_ = 0;
+public:
+    bool empty( ) const { return queue_.empty( ); }
+    std::size_t bytes( ) const { return bytes_; }
+
+    void push( std::shared_ptr<const std::string> data ) {
+        if ( data->empty( ) )
+            return;
+        bytes_ += data->size( );
+        queue_.push_back( std::move( data ) );
+    }
+
+    // Send as much as the socket takes without blocking, false on an error that ends the connection
+    bool flush( socket_t socket ) {
+        while ( !queue_.empty( ) ) {
+            const std::string& front = *queue_.front( );
+            const int sent = send( socket, front.data( ) + offset_, static_cast< int >( std::min<std::size_t>( front.size( ) - offset_, INT_MAX ) ), SEND_FLAGS );
+            if ( sent < 0 ) {
+                const int err = GET_ERROR;
+                if ( err == EINTR_ERR )
+                    continue;
+                return err == WOULD_BLOCK;
+            }
+
+            offset_ += static_cast< std::size_t >( sent );
+            bytes_ -= static_cast< std::size_t >( sent );
+            if ( offset_ == front.size( ) ) {
+                queue_.pop_front( );
+                offset_ = 0;
+            }
+        }
+        return true;
+    }
+
+    void clear( ) {
+        queue_.clear( );
+        offset_ = 0;
+        bytes_ = 0;
+    }
+};
@@ -0,0 +1,147 @@
+#pragma once
+#include "../Shared.hpp"
+
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Tracks who is online. Joins and leaves are collected into one delta per window instead of a line per
+// event, and the roster is kept sorted so a request is answered from a cached line.
+class Presence {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct Delta {
+        // More than one line once the names no longer fit in one, every line repeats the counts
+        std::vector<std::string> lines = {};
+        // For every connection whose own join is in lines, the same delta without it. No lines when nothing
+        // else changed, the connection then only needs the sequence numbers.
+        std::unordered_map<socket_t, std::vector<std::string>> own = {};
+    };
+private:
+    // Net change per name since the last delta, positive for joins and negative for leaves.
+    // A user that reconnects within the window cancels out and is not announced at all.
+    std::unordered_map<std::string, int> pending_ = {};
+    clock::time_point first_pending_ = {};
+    // Connections that joined since the last delta, they are not told about themselves
+    std::unordered_map<socket_t, std::string> joiners_ = {};
+
+    // Everyone logged in with the number of connections using each name
+    std::map<std::string, std::size_t> roster_ = {};
+    std::size_t online_ = 0;
+    // Framed roster line, rebuilt on the first request after a change
+    std::shared_ptr<const std::string> roster_line_ = {};
+public:
+    void join( const std::string& name, socket_t socket, clock::time_point now = clock::now( ) ) {
+        joiners_[ socket ] = name;
+        ++roster_[ name ];
+        ++online_;
+        roster_line_.reset( );
+        change( name, 1, now );
+    }
+
+    void leave( const std::string& name, clock::time_point now = clock::now( ) ) {
+        auto it = roster_.find( name );
+        if ( it == roster_.end( ) )
+            return;
+        if ( --it->second == 0 )
+            roster_.erase( it );
+        --online_;
+        roster_line_.reset( );
+        change( name, -1, now );
+    }
+
+    // The connection closed, it can no longer be told about anything. Its socket may be reused right away.
+    void forget( socket_t socket ) {
+        joiners_.erase( socket );
+    }
+
+    // Delta of everything that changed once window has passed since the first change, or nothing if none is due
+    std::optional<Delta> take_delta( clock::time_point now, std::chrono::milliseconds window ) {
+        if ( pending_.empty( ) || now - first_pending_ < window ) {
+            // A join that cancelled out with a leave is not announced to anyone
+            if ( pending_.empty( ) )
+                joiners_.clear( );
+            return std::nullopt;
+        }
+
+        Delta delta = {};
+        delta.lines = format_delta( nullptr );
+        // Connections that share a name get the same lines
+        std::unordered_map<std::string, std::vector<std::string>> by_name = {};
+        for ( const auto& [ socket, name ] : joiners_ ) {
+            auto it = pending_.find( name );
+            if ( it == pending_.end( ) || it->second <= 0 )
+                continue;
+            auto [ own, added ] = by_name.try_emplace( name );
+            if ( added )
+                own->second = format_delta( &name );
+            delta.own.emplace( socket, own->second );
+        }
+
+        pending_.clear( );
+        joiners_.clear( );
+        return delta;
+    }
+
+    // Roster lines including their delimiters, shared so they can be sent after the lock is released
+    std::shared_ptr<const std::string> roster( ) {
+        if ( roster_line_ != nullptr )
+            return roster_line_;
+
+        const std::string counts = std::format( "{} {}", roster_flag, online_ );
+        std::vector<std::string> lines = { counts };
+        for ( const auto& [ name, count ] : roster_ ) {
+            for ( std::size_t i = 0; i < count; ++i )
+                append_field( lines, counts, "", name );
+        }
+
+        std::string roster = {};
+        for ( const std::string& line : lines )
+            roster.append( line ).push_back( line_delimiter );
+        roster_line_ = std::make_shared<const std::string>( std::move( roster ) );
+        return roster_line_;
+    }
+private:
+    // Adds a name to the last line, or starts a new one with the same counts once it would get longer than a client accepts
+    static void append_field( std::vector<std::string>& lines, const std::string& counts, std::string_view sign, std::string_view name ) {
+        if ( lines.back( ).size( ) + 1 + sign.size( ) + name.size( ) > max_stream_length )
+            lines.push_back( counts );
+        lines.back( ).append( 1, field_separator ).append( sign ).append( name );
+    }
+
+    // Counts are exact and every name is listed, over several lines if needed.
+    // Leaves out one join of skip, or returns no lines if that was the only change.
+    std::vector<std::string> format_delta( const std::string* skip ) const {
+        std::size_t joined = 0, left = 0;
+        for ( const auto& [ name, count ] : pending_ )
+            ( count > 0 ? joined : left ) += static_cast< std::size_t >( std::abs( count ) );
+        if ( skip != nullptr ) {
+            if ( joined + left == 1 )
+                return { };
+            --joined;
+        }
+
+        const std::string counts = std::format( "{}{}{}{}", presence_flag, joined, field_separator, left );
+        std::vector<std::string> lines = { counts };
+        for ( const auto& [ name, count ] : pending_ ) {
+            const int skipped = skip != nullptr && name == *skip ? 1 : 0;
+            for ( int i = skipped; i < std::abs( count ); ++i )
+                append_field( lines, counts, count > 0 ? "+" : "-", name );
+        }
+        return lines;
+    }
+
+    void change( const std::string& name, int delta, clock::time_point now ) {
+        if ( pending_.empty( ) )
+            first_pending_ = now;
+
+        auto it = pending_.try_emplace( name, 0 ).first;
+        if ( ( it->second += delta ) == 0 )
+            pending_.erase( it );
+    }
+};
@@ -0,0 +1,110 @@
+#pragma once
+#include "../Shared.hpp"
+
+#include <vector>
+
+// Most file payload bytes moved per call, also the default capacity of a Linux pipe
+constexpr static const std::size_t relay_budget = 64 * 1024;
+// The sender of a file is not read while its receiver has more than this queued, until it is under relay_budget again
+constexpr static const std::size_t relay_queue_limit = 4 * relay_budget;
+
+// Moves file transfer payloads from the sending socket to the receiving one. On Linux the bytes go
+// through a pipe with splice() and never enter userspace while the receiver keeps up, elsewhere they
+// are copied through a buffer. Whatever the receiver can not take right away is taken out and queued.
+class Relay {
+private:
+#ifdef __linux__
+    int pipe_[ 2 ] = { -1, -1 };
+#else
+    std::vector<char> buffer_ = std::vector<char>( relay_budget );
+#endif
+    // Bytes pulled from the source that have not been pushed to a destination yet
+    std::size_t buffered_ = 0;
+public:
+    Relay( ) {
+#ifdef __linux__
+        if ( pipe2( pipe_, O_NONBLOCK | O_CLOEXEC ) != 0 )
+            throw std::runtime_error( std::format( "Failed to create relay pipe: {}", GET_ERROR ) );
+#endif
+    }
+
+    ~Relay( ) {
+#ifdef __linux__
+        close( pipe_[ 0 ] );
+        close( pipe_[ 1 ] );
+#endif
+    }
+
+    Relay( const Relay& ) = delete;
+    Relay& operator=( const Relay& ) = delete;
+
+    std::size_t buffered( ) const { return buffered_; }
+
+    // Pull up to length bytes from source without blocking, returns the bytes moved like recv
+    int fill( socket_t source, std::size_t length ) {
+        length = std::min( length, relay_budget - buffered_ );
+#ifdef __linux__
+        const ssize_t moved = splice( source, nullptr, pipe_[ 1 ], nullptr, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+#else
+        const int moved = recv( source, buffer_.data( ) + buffered_, static_cast< int >( length ), 0 );
+#endif
+        if ( moved > 0 )
+            buffered_ += static_cast< std::size_t >( moved );
+        return static_cast< int >( moved );
+    }
+
+    // Push as much as destination takes without blocking, the rest stays buffered. False on an error that ends the connection.
+    bool push( socket_t destination ) {
+        while ( buffered_ > 0 ) {
+#ifdef __linux__
+            const ssize_t moved = splice( pipe_[ 0 ], nullptr, destination, nullptr, buffered_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+#else
+            const int moved = send( destination, buffer_.data( ), static_cast< int >( buffered_ ), SEND_FLAGS );
+#endif
+            if ( moved < 0 ) {
+                const int err = GET_ERROR;
+                if ( err == EINTR_ERR )
+                    continue;
+                return err == WOULD_BLOCK;
+            }
+            buffered_ -= static_cast< std::size_t >( moved );
+#ifndef __linux__
+            std::memmove( buffer_.data( ), buffer_.data( ) + moved, buffered_ );
+#endif
+        }
+        return true;
+    }
+
+    // Append everything buffered to out
+    void take( std::string& out ) {
+#ifdef __linux__
+        const std::size_t start = out.size( );
+        out.resize( start + buffered_ );
+        std::size_t got = 0;
+        while ( got < buffered_ ) {
+            const ssize_t result = read( pipe_[ 0 ], out.data( ) + start + got, buffered_ - got );
+            if ( result <= 0 )
+                break;
+            got += static_cast< std::size_t >( result );
+        }
+        out.resize( start + got );
+#else
+        out.append( buffer_.data( ), buffered_ );
+#endif
+        buffered_ = 0;
+    }
+
+    // Throw away everything buffered, used when the destination went away
+    void discard( ) {
+#ifdef __linux__
+        char scratch[ 4096 ];
+        while ( buffered_ > 0 ) {
+            const ssize_t got = read( pipe_[ 0 ], scratch, std::min( sizeof( scratch ), buffered_ ) );
+            if ( got <= 0 )
+                break;
+            buffered_ -= static_cast< std::size_t >( got );
+        }
+#endif
+        buffered_ = 0;
+    }
+};
@@ -1,52 +1,117 @@
 ﻿#include "Server.hpp"
 
-void Server::cleanup_client( socket_t client_socket, std::string username, bool http_request ) {
+void Server::cleanup_client( socket_t client_socket, const std::shared_ptr<Connection>& expected, std::string username, bool silent ) {
 	// If there is no username set it to "<unknown>"
     if ( username.empty( ) )
         username = "<unknown>";
 
-    // Always remove from the master fd_set
-    FD_CLR( client_socket, &master_set_ );
-
 	// Remove the client from the clients set and socket set
+    std::shared_ptr<Connection> connection = {};
+    std::string token = "";
     {
         std::lock_guard lock( clients_mutex_ );
 
-        // If the users socket is not found they have already disconnected so we can exit early
-		if ( clients_.contains( client_socket ) == false )
+        // If the users socket is not found they have already disconnected so we can exit early,
+        // a different connection means the socket number was already reused for a new client
+        auto it = clients_.find( client_socket );
+		if ( it == clients_.end( ) || it->second != expected )
 			return;
 
-        clients_.erase( client_socket );
-        socket_set_.erase( client_socket );
+        connection = std::move( it->second );
+        clients_.erase( it );
+    }
+    {
+        std::lock_guard lock( history_mutex_ );
+        token = connection->session;
+    }
+    {
+        // Remove from the master fd_set of its event loop, the loop copies it under the same lock
+        EventLoop& loop = loops_[ connection->loop ];
+        std::lock_guard lock( loop.mutex );
+        FD_CLR( client_socket, &loop.master_set );
+        loop.connections.erase( client_socket );
     }
 
 	// Remove the user from the user map
+    std::string logged_in_as = "";
     {
         std::lock_guard lock( user_mutex_ );
-        users_.erase( client_socket );
+        if ( auto it = users_.find( client_socket ); it != users_.end( ) ) {
+            logged_in_as = std::move( it->second );
+            users_.erase( it );
+        }
     }
 
-	// Close the client socket
-    CLOSESOCKET( client_socket );
-
-    if ( http_request == false ) {
-        // Send a disconnect message to all other clients indicating the user has disconnected
-        const std::string disconnect_message = std::format( "[{}] Server: {} has disconnected.", Shared::get_current_time( ), username );
-        {
-            std::lock_guard lock( clients_mutex_ );
-            for ( const socket_t& socket : clients_ ) {
-                if ( send( socket, disconnect_message.c_str( ), static_cast< int >( disconnect_message.size( ) ), 0 ) < 0 ) {
-                    std::cerr << "Failed to send disconnect message: " << GET_ERROR << std::endl;
-                }
+    // Keep the session of a dropped user around for a while so the client can resume it without anyone noticing
+    bool kept = false;
+    if ( !logged_in_as.empty( ) && !token.empty( ) ) {
+        std::lock_guard lock( session_mutex_ );
+        if ( auto it = sessions_.find( token ); it != sessions_.end( ) ) {
+            // Unless a new connection already took the session over, detach it or end it
+            kept = true;
+            if ( it->second.socket == client_socket && silent == false ) {
+                it->second.socket = INVALID_SOCKET_VAL;
+                it->second.detached_at = std::chrono::steady_clock::now( );
+                detached_.emplace_back( it->second.detached_at, token );
+            }
+            else if ( it->second.socket == client_socket ) {
+                sessions_.erase( it );
+                kept = false;
             }
         }
+    }
 
-        // Print the disconnect message to the console
-        std::cout << disconnect_message << std::endl;
+    // Take the user off the roster, the leave goes out with the next presence delta
+    if ( !logged_in_as.empty( ) ) {
+        std::lock_guard lock( presence_mutex_ );
+        presence_.forget( client_socket );
+        if ( !kept )
+            presence_.leave( logged_in_as );
+    }
+
+    // Drop any pending handshake, idle or pong timer
+    {
+        std::lock_guard lock( timer_mutex_ );
+        timers_.remove( client_socket, connection->id );
+    }
+
+    // Tell the receiver of an unfinished file transfer that it will not complete
+    {
+        std::lock_guard lock( connection->read_mutex );
+        if ( trace_ != nullptr )
+            trace_->record( Trace::EventKind::Disconnect, connection->id );
+        if ( connection->upload.has_value( ) ) {
+            if ( auto recipient = connection->upload->recipient.lock( ) )
+                send_to( connection->upload->recipient_socket, *recipient, std::format( "{}{}", cancel_flag, connection->upload->id ) );
+            connection->upload.reset( );
+        }
     }
+
+	// Close the client socket, once no sender can still be writing to it
+    {
+        std::lock_guard lock( connection->write_mutex );
+        connection->closed = true;
+        connection->outbox.clear( );
+        resume_senders_locked( *connection );
+        CLOSESOCKET( client_socket );
+    }
+
+    // Print the disconnect message to the console, for a kept session that happens once it expires
+    if ( silent == false && !kept )
+        std::cout << std::format( "[{}] Server: {} has disconnected.", Shared::get_current_time( ), username ) << std::endl;
 }
 
-void Server::handle_client( socket_t client_socket ) {
+void Server::handle_client( socket_t client_socket, const std::shared_ptr<Connection>& connection ) {
+    // Another worker is already reading this client, it will pick up whatever is pending
+    std::unique_lock read_lock( connection->read_mutex, std::try_to_lock );
+    if ( !read_lock.owns_lock( ) )
+        return;
+
+    // The task may have been queued before the connection was cleaned up and its socket number handed to a new client.
+    // Cleanup takes the read lock before closing the socket, so once this holds the socket stays ours.
+    if ( find_connection( client_socket ) != connection )
+        return;
+
     std::string username = "";
 
     // Check if the client is a new user or an existing one
@@ -70,133 +135,645 @@ void Server::handle_client( socket_t client_socket ) {
     }
 
     try {
-        int bytes_received = 0;
-        char username_buffer[ max_username_length + 1U ] = {};
-        char message_buffer[ max_message_length + 1U ] = {};
-
-		// If the client is a new user, we need to receive their username
-        if ( is_new_user ) {
-			// Wait for the client to send their username
-            bytes_received = Shared::receive_data( client_socket, username_buffer );
+        // A send to it failed, nothing it sends matters anymore
+        {
+            std::lock_guard<std::mutex> write_lock( connection->write_mutex );
+            if ( connection->closed )
+                throw std::runtime_error( "Send failed" );
+        }
+
+        // Bound the work done per wake up so one busy client can not starve the others
+        std::size_t budget = relay_budget;
+        while ( budget > 0 ) {
+            // Payload of a data frame goes straight to the receiver without being parsed
+            if ( connection->upload.has_value( ) && connection->upload->frame_remaining > 0 ) {
+                if ( pause_upload( client_socket, connection ) )
+                    return;
+                const int moved = relay_upload( client_socket, *connection, budget );
+                if ( moved <= 0 ) {
+                    const int err = GET_ERROR;
+                    // If the error is a non-blocking error or interrupted, just return
+                    if ( moved < 0 && ( err == WOULD_BLOCK || err == EINTR_ERR ) ) return;
+                    throw std::runtime_error( moved == 0 ? "Client disconnected during file transfer" : std::format( "File relay failed: {}", err ) );
+                }
+                budget -= std::min( budget, static_cast< std::size_t >( moved ) );
+                if ( trace_ != nullptr )
+                    trace_->record( Trace::EventKind::Data, connection->id, {}, static_cast< std::uint64_t >( moved ) );
+                arm_timer( client_socket, *connection, TimerKind::Idle, idle_timeout );
+                continue;
+            }
+
+			// Read the next line, new users have to send their username first
+            bool complete = false;
+            const int bytes_received = Shared::receive_line( client_socket, connection->line, complete, is_new_user );
 			// Check if the request was a HTTP request
             if ( bytes_received == HTTP_DETECTED )
                 throw std::runtime_error( "HTTP request" );
+            if ( bytes_received == LINE_TOO_LONG )
+                throw std::runtime_error( "Line too long" );
 
             // Check if we received any data
             if ( bytes_received <= 0 ) {
                 const int err = GET_ERROR;
                 // If the error is a non-blocking error or interrupted, just return
                 if ( bytes_received < 0 && ( err == WOULD_BLOCK || err == EINTR_ERR ) ) return;
-                throw std::runtime_error( bytes_received == 0 ? "Client disconnected before username" : std::format( "Username recv failed: {}", err ) );
+                throw std::runtime_error( bytes_received == 0 ? ( is_new_user ? "Client disconnected before username" : "Client disconnected" ) : std::format( "Recv failed: {}", err ) );
+            }
+            budget -= std::min( budget, static_cast< std::size_t >( bytes_received ) );
+
+            // Any traffic proves a logged in client is alive, including a pong or a ping that is still in flight
+            if ( !is_new_user )
+                arm_timer( client_socket, *connection, TimerKind::Idle, idle_timeout );
+
+            if ( !complete )
+                continue;
+
+            const std::string line = std::move( connection->line );
+            connection->line.clear( );
+
+            if ( trace_ != nullptr )
+                trace_->record( Trace::EventKind::Line, connection->id, line );
+
+            // Handle regular messages
+            if ( !is_new_user ) {
+                handle_line( client_socket, *connection, username, line );
+                continue;
+            }
+
+            // A client that can inflate frames says so before logging in, without zlib the request is ignored
+            if ( line.starts_with( compress_flag ) ) {
+                connection->compressed = Compress::available( ) && line.substr( compress_flag.size( ) ) == Compress::codec;
+                continue;
             }
 
-			// Ensure the username does not exceed the maximum length
-            username.assign( username_buffer, std::min( bytes_received, max_username_length ) );
+            // A reconnecting client sends its session token, the last sequence number it saw and its username
+            std::string_view login = line;
+            std::string token = "";
+            std::optional<std::uint64_t> resume_after = {};
+            if ( login.starts_with( resume_flag ) ) {
+                const std::vector<std::string_view> fields = Shared::split_fields( login.substr( resume_flag.size( ) ) );
+                std::uint64_t after = 0;
+                if ( fields.size( ) != 3 || !Shared::parse_number( fields[ 1 ], after ) )
+                    throw std::runtime_error( "Invalid resume request" );
+
+                // An unknown or expired session falls back to a regular login with the username
+                token = std::string( fields[ 0 ] );
+                username = resume_session( client_socket, token );
+                if ( !username.empty( ) )
+                    resume_after = after;
+                login = fields[ 2 ];
+            }
+
+            if ( !resume_after.has_value( ) ) {
+                // Ensure the username does not exceed the maximum length and is safe to print
+                username = Sanitize::truncate( Sanitize::sanitize( login ), max_username_length );
+                if ( username.empty( ) )
+                    throw std::runtime_error( "Invalid username" );
+                token = create_session( client_socket, username );
+            }
 
             // Set the username in the user map ensuring it does not exceed the maximum length
             {
                 std::lock_guard<std::mutex> user_lock( user_mutex_ );
                 users_.at( client_socket ) = username;
             }
+            is_new_user = false;
 
-			// Send a welcome message to all other clients indicating the new user has joined
-            const std::string welcome_message = std::format( "[{}] {} has joined the chat.", Shared::get_current_time( ), username );
-            {
-                std::lock_guard<std::mutex> clients_lock( clients_mutex_ );
-                for ( const socket_t& socket : clients_ ) {
-                    if ( socket != client_socket ) {
-						if ( send( socket, welcome_message.c_str( ), static_cast< int >( welcome_message.size( ) ), 0 ) < 0 ) {
-							throw std::runtime_error( std::format( "Failed to send welcome message: {}", GET_ERROR ) );
-						}
-                    }
+            // The handshake is done so replace the handshake deadline with the idle timer
+            arm_timer( client_socket, *connection, TimerKind::Idle, idle_timeout );
+
+            if ( resume_after.has_value( ) ) {
+                // A resumed user never left the roster so nobody is told about the reconnect
+                std::cout << std::format( "[{}] {} resumed their session.", Shared::get_current_time( ), username ) << std::endl;
+            }
+            else {
+			    // Put the user on the roster, the other clients learn about it with the next presence delta
+                {
+                    std::lock_guard<std::mutex> presence_lock( presence_mutex_ );
+                    presence_.join( username, client_socket );
                 }
+
+			    // Print the welcome message to the console
+                std::cout << std::format( "[{}] {} has joined the chat.", Shared::get_current_time( ), username ) << std::endl;
             }
 
-			// Print the welcome message to the console
-            std::cout << welcome_message << std::endl;
-            return;
+            // Start receiving broadcasts, after whatever a resumed session missed
+            start_session( client_socket, *connection, token, resume_after );
         }
+    }
+    catch ( const std::exception& e ) {
+        const std::string msg = e.what( );
+        // cleanup_client takes the read lock itself
+        read_lock.unlock( );
+        // HTTP requests and clients that never finished the handshake leave silently
+        cleanup_client( client_socket, connection, username, msg == "HTTP request" || username.empty( ) );
+#ifdef _DEBUG
+        std::cout << std::format( "[{}] Client disconnected: {}", Shared::get_current_time( ), msg ) << std::endl;
+#endif
+    }
+}
 
-		// Wait for the client to send a message
-        bytes_received = Shared::receive_data( client_socket, message_buffer );
-        // Check if the request was a HTTP request
-        if ( bytes_received == HTTP_DETECTED )
-            throw std::runtime_error( "HTTP request" );
+void Server::handle_line( socket_t client_socket, Connection& connection, const std::string& username, std::string_view line ) {
+    // A pong only exists to reset the idle timer
+    if ( line.starts_with( pong_flag ) )
+        return;
 
-        // Check if we received any data
-        if ( bytes_received <= 0 ) {
-            const int err = GET_ERROR;
-            // If the error is a non-blocking error or interrupted, just return
-            if ( bytes_received < 0 && ( err == WOULD_BLOCK || err == EINTR_ERR ) ) return;
-            throw std::runtime_error( bytes_received == 0 ? "Client disconnected before username" : std::format( "Username recv failed: {}", err ) );
+    // Answer a roster request from the maintained snapshot
+    if ( line.starts_with( roster_flag ) ) {
+        std::shared_ptr<const std::string> roster = {};
+        {
+            std::lock_guard<std::mutex> presence_lock( presence_mutex_ );
+            roster = presence_.roster( );
         }
 
-		// Get the user message ensuring it does not exceed the maximum length
-        std::string user_message( message_buffer, std::min( bytes_received, max_message_length ) );
+        std::lock_guard<std::mutex> write_lock( connection.write_mutex );
+        if ( queue_locked( client_socket, connection, std::move( roster ) ) )
+            flush_locked( client_socket, connection );
+        if ( connection.closed )
+            throw std::runtime_error( "Failed to send roster" );
+        return;
+    }
 
-		// Check if the message starts with the message flag if not return ignore it
-        if ( !user_message.starts_with( message_flag ) )
-            return;
+    // Collect the parts of a long message until the final part arrives
+    if ( line.starts_with( chunk_flag ) ) {
+        line.remove_prefix( chunk_flag.size( ) );
+        connection.chunks.append( line.substr( 0, max_stream_length - std::min( max_stream_length, connection.chunks.size( ) ) ) );
+        return;
+    }
+
+    // Start of a file transfer
+    if ( line.starts_with( file_flag ) ) {
+        start_upload( client_socket, connection, username, line.substr( file_flag.size( ) ) );
+        return;
+    }
+
+    // Header of the next slice of the file being transferred
+    if ( line.starts_with( data_flag ) ) {
+        std::uint64_t length = 0;
+        if ( !connection.upload.has_value( ) || !Shared::parse_number( line.substr( data_flag.size( ) ), length ) ||
+             length == 0 || length > connection.upload->remaining )
+            throw std::runtime_error( "Invalid data frame" );
+        connection.upload->frame_remaining = length;
+        return;
+    }
+
+	// Check if the message starts with the message flag if not return ignore it
+    if ( !line.starts_with( message_flag ) )
+        return;
+    line.remove_prefix( message_flag.size( ) );
+
+    // Prepend the earlier parts of a long message
+    std::string user_message = std::move( connection.chunks );
+    connection.chunks.clear( );
+    user_message.append( line.substr( 0, max_stream_length - std::min( max_stream_length, user_message.size( ) ) ) );
+
+	// Strip anything that could mess with other users terminals
+    user_message = Sanitize::sanitize( user_message );
+
+	// Send the final message to all other clients in the chat
+    const std::string final_message = std::format( "[{}] {}: {}", Shared::get_current_time( ), username, user_message );
+    broadcast( final_message, client_socket );
+
+	// Print the message to the console
+    std::cout << final_message << std::endl;
+}
+
+void Server::start_upload( socket_t client_socket, Connection& connection, const std::string& username, std::string_view header ) {
+    // A client sends one file at a time
+    if ( connection.upload.has_value( ) )
+        throw std::runtime_error( "File transfer already in progress" );
+
+    // Header is the file size, the receiving user and the file name
+    const std::vector<std::string_view> fields = Shared::split_fields( header );
+    std::uint64_t size = 0;
+    if ( fields.size( ) != 3 || !Shared::parse_number( fields[ 0 ], size ) )
+        throw std::runtime_error( "Invalid file header" );
+
+    Upload upload = {};
+    upload.id = next_transfer_id_++;
+    upload.name = Sanitize::truncate( Sanitize::sanitize( fields[ 2 ] ), max_username_length * 4 );
+    upload.recipient_name = Sanitize::truncate( Sanitize::sanitize( fields[ 1 ] ), max_username_length );
+    upload.remaining = size;
+
+    // Find the receiving user
+    socket_t recipient_socket = INVALID_SOCKET_VAL;
+    {
+        std::lock_guard<std::mutex> user_lock( user_mutex_ );
+        for ( const auto& [ socket, name ] : users_ ) {
+            if ( socket != client_socket && name == upload.recipient_name ) {
+                recipient_socket = socket;
+                break;
+            }
+        }
+    }
 
-		// Remove the message flag from the message
-        user_message.erase( 0, message_flag.size( ) );
+    // The client streams the file right after the header, so even a rejected transfer is received and dropped
+    std::string error = "";
+    if ( size > max_file_size )
+        error = std::format( "{} is too large to send", upload.name );
+    else if ( upload.name.empty( ) )
+        error = "Invalid file name";
+    else if ( recipient_socket == INVALID_SOCKET_VAL )
+        error = std::format( "{} is not online", upload.recipient_name );
 
-		// Send the final message to all other clients in the chat
-        const std::string final_message = std::format( "[{}] {}: {}", Shared::get_current_time( ), username, user_message );
+    if ( error.empty( ) ) {
+        // Announce the transfer to the receiver
+        std::shared_ptr<Connection> recipient = find_connection( recipient_socket );
+        if ( recipient != nullptr &&
+             send_to( recipient_socket, *recipient, std::format( "{}{}{}{}{}{}{}{}", file_flag, upload.id, field_separator, size, field_separator, username, field_separator, upload.name ) ) ) {
+            upload.recipient = recipient;
+            upload.recipient_socket = recipient_socket;
+        }
+        else
+            error = std::format( "{} is not online", upload.recipient_name );
+    }
+
+    if ( !error.empty( ) )
+        send_to( client_socket, connection, std::format( "[{}] Server: {}", Shared::get_current_time( ), error ) );
+
+    // Nothing follows the header of an empty file
+    if ( size == 0 )
+        return;
+
+    upload.relay = std::make_unique<Relay>( );
+    connection.upload = std::move( upload );
+
+    std::cout << std::format( "[{}] {} is sending {} ({} bytes) to {}", Shared::get_current_time( ), username, connection.upload->name, size, connection.upload->recipient_name ) << std::endl;
+}
+
+int Server::relay_upload( socket_t client_socket, Connection& connection, std::size_t budget ) {
+    Upload& upload = *connection.upload;
+
+    // Pull whatever part of the frame has arrived, without copying it on Linux
+    const int moved = upload.relay->fill( client_socket, static_cast< std::size_t >( std::min<std::uint64_t>( upload.frame_remaining, budget ) ) );
+    if ( moved <= 0 )
+        return moved;
+
+    // Forward it to the receiver as one frame, the write lock lets chat lines in between frames but never inside one
+    bool delivered = false;
+    if ( std::shared_ptr<Connection> recipient = upload.recipient.lock( ) ) {
         {
-            std::lock_guard<std::mutex> clients_lock( clients_mutex_ );
-            for ( const socket_t& socket : clients_ ) {
-                if ( socket != client_socket ) {
-					if ( send( socket, final_message.c_str( ), static_cast< int >( final_message.size( ) ), 0 ) < 0 )
-						throw std::runtime_error( std::format( "Failed to send message: {}", GET_ERROR ) );
+            std::lock_guard<std::mutex> write_lock( recipient->write_mutex );
+            Connection& target = *recipient;
+            if ( queue_locked( upload.recipient_socket, target, std::make_shared<const std::string>( std::format( "{}{}{}{}{}", data_flag, upload.id, field_separator, moved, line_delimiter ) ) ) ) {
+                flush_locked( upload.recipient_socket, target );
+                // With nothing queued ahead of it the payload goes out straight from the pipe
+                if ( !target.closed && target.outbox.empty( ) && !upload.relay->push( upload.recipient_socket ) )
+                    fail_locked( upload.recipient_socket, target );
+                // and only what the socket did not take is copied into the outbox, right behind its header
+                if ( !target.closed && upload.relay->buffered( ) > 0 ) {
+                    auto rest = std::make_shared<std::string>( );
+                    upload.relay->take( *rest );
+                    if ( queue_locked( upload.recipient_socket, target, std::move( rest ) ) )
+                        flush_locked( upload.recipient_socket, target );
                 }
             }
+            delivered = !target.closed;
         }
 
-		// Print the message to the console
-        std::cout << final_message << std::endl;
+        // The receiver went away, drain the rest of the file. Never notify while holding the receivers write lock,
+        // a transfer in the other direction could be waiting on ours.
+        if ( !delivered ) {
+            upload.recipient.reset( );
+            send_to( client_socket, connection, std::format( "[{}] Server: Transfer of {} failed, {} disconnected", Shared::get_current_time( ), upload.name, upload.recipient_name ) );
+        }
     }
-    catch ( const std::exception& e ) {
-        const std::string msg = e.what( );
-        cleanup_client( client_socket, username, msg == "HTTP request" );
-#ifdef _DEBUG
-        std::cout << std::format( "[{}] Client disconnected: {}", Shared::get_current_time( ), msg ) << std::endl;
-#endif
+    if ( !delivered )
+        upload.relay->discard( );
+
+    upload.frame_remaining -= static_cast< std::uint64_t >( moved );
+    upload.remaining -= static_cast< std::uint64_t >( moved );
+
+    // Transfer complete
+    if ( upload.remaining == 0 ) {
+        std::cout << std::format( "[{}] Transfer of {} to {} {}", Shared::get_current_time( ), upload.name, upload.recipient_name, delivered ? "finished" : "dropped" ) << std::endl;
+        connection.upload.reset( );
+    }
+
+    return moved;
+}
+
+std::shared_ptr<Connection> Server::find_connection( socket_t client_socket ) {
+    std::lock_guard<std::mutex> lock( clients_mutex_ );
+    auto it = clients_.find( client_socket );
+    return it != clients_.end( ) ? it->second : nullptr;
+}
+
+bool Server::send_to( socket_t client_socket, Connection& connection, std::string_view text ) {
+    auto line = std::make_shared<std::string>( text );
+    line->push_back( line_delimiter );
+
+    std::lock_guard<std::mutex> write_lock( connection.write_mutex );
+    if ( queue_locked( client_socket, connection, std::move( line ) ) )
+        flush_locked( client_socket, connection );
+    return !connection.closed;
+}
+
+bool Server::queue_locked( socket_t client_socket, Connection& connection, std::shared_ptr<const std::string> data ) {
+    if ( connection.closed )
+        return false;
+
+    // A receiver this far behind would only fall further behind, drop it instead of buffering without end
+    connection.outbox.push( std::move( data ) );
+    if ( connection.outbox.bytes( ) > max_outbox_bytes ) {
+        fail_locked( client_socket, connection );
+        return false;
     }
+    return true;
 }
 
-void Server::accept_new_client( ) {
-	// Accept a new client connection
-    socket_t client_socket = accept( server_socket_, nullptr, nullptr );
-	// Check if the client socket is valid
-    if ( client_socket == INVALID_SOCKET_VAL )
+void Server::flush_locked( socket_t client_socket, Connection& connection ) {
+    if ( connection.closed )
         return;
+    if ( !connection.outbox.flush( client_socket ) ) {
+        fail_locked( client_socket, connection );
+        return;
+    }
 
-	// Check if the maximum number of connections has been reached
-	{
-		std::lock_guard<std::mutex> lock( clients_mutex_ );
-		if ( clients_.size( ) >= FD_SETSIZE ) {
-			std::cerr << "Too many connections." << std::endl;
-			CLOSESOCKET( client_socket );
-			return;
-		}
-	}
+    // Let the event loop send the rest once the socket has room again
+    if ( !connection.outbox.empty( ) && !connection.want_write.exchange( true ) )
+        wake( loops_[ connection.loop ] );
+    if ( connection.outbox.bytes( ) < relay_budget )
+        resume_senders_locked( connection );
+}
+
+void Server::fail_locked( socket_t client_socket, Connection& connection ) {
+    // Whatever was queued can never be delivered in order, so nothing more is sent. The shutdown makes the
+    // socket readable, the worker that reads the end of stream cleans the connection up.
+    connection.closed = true;
+    connection.outbox.clear( );
+    shutdown( client_socket, SD_BOTH );
+    resume_senders_locked( connection );
+
+    // A paused sender has to be read again to see the end of stream
+    if ( connection.paused.exchange( false ) )
+        wake( loops_[ connection.loop ] );
+}
+
+bool Server::pause_upload( socket_t client_socket, const std::shared_ptr<Connection>& connection ) {
+    std::shared_ptr<Connection> recipient = connection->upload->recipient.lock( );
+    if ( recipient == nullptr )
+        return false;
+
+    // Stop reading the sender while its receiver is behind, TCP then slows the sender down instead of the outbox growing
+    std::lock_guard<std::mutex> write_lock( recipient->write_mutex );
+    if ( recipient->closed || recipient->outbox.bytes( ) < relay_queue_limit )
+        return false;
+    connection->paused = true;
+    recipient->paused_senders.emplace_back( client_socket, connection );
+
+    // A sender that is not read can not answer a ping, its timers wait until it is resumed
+    std::lock_guard<std::mutex> timer_lock( timer_mutex_ );
+    timers_.cancel( client_socket, connection->id );
+    return true;
+}
+
+void Server::resume_senders_locked( Connection& connection ) {
+    for ( const auto& [ sender_socket, weak_sender ] : connection.paused_senders ) {
+        if ( std::shared_ptr<Connection> sender = weak_sender.lock( ); sender != nullptr && sender->paused.exchange( false ) ) {
+            arm_timer( sender_socket, *sender, TimerKind::Idle, idle_timeout );
+            wake( loops_[ sender->loop ] );
+        }
+    }
+    connection.paused_senders.clear( );
+}
+
+void Server::flush_client( socket_t client_socket, const std::shared_ptr<Connection>& connection ) {
+    std::lock_guard<std::mutex> write_lock( connection->write_mutex );
+    flush_locked( client_socket, *connection );
+}
+
+void Server::broadcast( std::string_view message, socket_t except, const std::unordered_map<socket_t, std::string>& own ) {
+    // Compress the message before taking the lock, its number goes in front of the frame uncompressed.
+    // A client that asked for compression still takes plain lines, so guessing wrong only costs the work.
+    std::optional<std::string> frame = {};
+    if ( compress_broadcasts_ ) {
+        std::string body = {};
+        body.reserve( message.size( ) + 1 );
+        body.append( message ).push_back( line_delimiter );
+        frame = Compress::frame( body );
+    }
+
+    // Receivers whose outbox was empty, they are sent to once the history lock is released
+    std::vector<std::pair<socket_t, std::shared_ptr<Connection>>> to_flush = {};
+    {
+        std::lock_guard<std::mutex> history_lock( history_mutex_ );
+
+        // Number the message and frame it once for every receiver, the sender only learns the number
+        const std::uint64_t sequence = next_sequence_++;
+        const std::string header = std::format( "{}{}", sequence_flag, sequence );
+        auto line = std::make_shared<std::string>( );
+        line->reserve( header.size( ) + message.size( ) + 2 );
+        line->append( header ).append( 1, field_separator ).append( message ).push_back( line_delimiter );
+        auto acknowledgement = std::make_shared<const std::string>( header + line_delimiter );
+        // Shared by every receiver that asked for compression
+        std::shared_ptr<const std::string> compressed = {};
+        if ( frame.has_value( ) ) {
+            std::string numbered = {};
+            numbered.reserve( header.size( ) + 1 + frame->size( ) );
+            numbered.append( header ).append( 1, field_separator ).append( *frame );
+            compressed = std::make_shared<const std::string>( std::move( numbered ) );
+        }
+        bool any_compressed = false;
 
-	// Set the client socket to non-blocking mode
+        // Keep it for sessions that resume later, dropping the oldest lines past the limits
+        HistoryEntry entry = {};
+        entry.sequence = sequence;
+        if ( std::shared_ptr<Connection> sender = find_connection( except ) )
+            entry.origin = sender->session;
+        entry.line = *line;
+        history_size_ += entry.line.size( );
+        history_.push_back( std::move( entry ) );
+        while ( history_.size( ) > history_length || history_size_ > history_bytes ) {
+            history_size_ -= history_.front( ).line.size( );
+            history_.pop_front( );
+        }
+
+        // Each loop is only locked while its receivers are collected, so it keeps serving while they are queued to
+        std::vector<std::pair<socket_t, std::shared_ptr<Connection>>> receivers = {};
+        for ( EventLoop& loop : loops_ ) {
+            std::lock_guard<std::mutex> loop_lock( loop.mutex );
+            for ( const auto& [ socket, connection ] : loop.connections ) {
+                // Clients still logging in get nothing, they start with the next number once they are in
+                if ( connection->ready )
+                    receivers.emplace_back( socket, connection );
+            }
+        }
+
+        // Queueing under the history lock keeps every outbox in sequence order, nothing is sent here
+        std::shared_ptr<const std::string> shared_line = std::move( line );
+        for ( auto& [ socket, connection ] : receivers ) {
+            std::shared_ptr<const std::string> text = socket == except ? acknowledgement : shared_line;
+            if ( auto it = own.find( socket ); it != own.end( ) ) {
+                // Receivers the message is about get their own version of it
+                text = it->second.empty( ) ? acknowledgement : std::make_shared<const std::string>( std::format( "{}{}{}{}", header, field_separator, it->second, line_delimiter ) );
+            }
+            else if ( connection->compressed && socket != except ) {
+                any_compressed = true;
+                if ( compressed != nullptr )
+                    text = compressed;
+            }
+
+            std::lock_guard<std::mutex> write_lock( connection->write_mutex );
+            const bool idle = connection->outbox.empty( );
+            if ( queue_locked( socket, *connection, std::move( text ) ) && idle )
+                to_flush.emplace_back( socket, std::move( connection ) );
+        }
+        compress_broadcasts_ = any_compressed;
+    }
+
+    // A receiver that already had something queued is flushed by its event loop once it can take more
+    for ( const auto& [ socket, connection ] : to_flush )
+        flush_client( socket, connection );
+}
+
+std::string Server::create_session( socket_t client_socket, const std::string& username ) {
+    // 128 random bits, a token is all it takes to take over a session
+    std::random_device random = {};
+    std::string token = std::format( "{:08x}{:08x}{:08x}{:08x}", random( ), random( ), random( ), random( ) );
+
+    Session session = {};
+    session.username = username;
+    session.socket = client_socket;
+
+    std::lock_guard<std::mutex> lock( session_mutex_ );
+    sessions_[ token ] = std::move( session );
+    return token;
+}
+
+std::string Server::resume_session( socket_t client_socket, const std::string& token ) {
+    std::lock_guard<std::mutex> lock( session_mutex_ );
+    auto it = sessions_.find( token );
+    if ( it == sessions_.end( ) )
+        return "";
+
+    // The old connection may not have noticed it is dead yet, end it so this one takes over.
+    // It is only closed after its cleanup released the session, which can not happen while we hold the lock.
+    if ( it->second.socket != INVALID_SOCKET_VAL )
+        shutdown( it->second.socket, SD_BOTH );
+    it->second.socket = client_socket;
+    return it->second.username;
+}
+
+void Server::start_session( socket_t client_socket, Connection& connection, const std::string& token, std::optional<std::uint64_t> resume_after ) {
+    // Hold the write lock from before broadcasts reach the connection until the missed lines are sent,
+    // so the client gets every line in sequence order. std::lock because broadcast takes the two the other way round.
+    std::unique_lock<std::mutex> history_lock( history_mutex_, std::defer_lock );
+    std::unique_lock<std::mutex> write_lock( connection.write_mutex, std::defer_lock );
+    std::lock( history_lock, write_lock );
+
+    std::string lines = std::format( "{}{}{}", session_flag, token, line_delimiter );
+    if ( resume_after.has_value( ) ) {
+        // Tell the client if part of what it missed already fell out of the history
+        const std::uint64_t oldest = history_.empty( ) ? next_sequence_ : history_.front( ).sequence;
+        if ( *resume_after + 1 < oldest )
+            lines.append( std::format( "[{}] Server: {} messages sent while you were away are no longer available{}", Shared::get_current_time( ), oldest - *resume_after - 1, line_delimiter ) );
+
+        for ( const HistoryEntry& entry : history_ ) {
+            if ( entry.sequence > *resume_after && entry.origin != token )
+                lines.append( entry.line );
+        }
+    }
+
+    connection.session = token;
+    connection.ready = true;
+    history_lock.unlock( );
+
+    // Everything missed goes out as one frame, which compresses far better than the lines one by one
+    if ( connection.compressed ) {
+        if ( std::optional<std::string> frame = Compress::frame( lines ) )
+            lines = std::move( *frame );
+    }
+
+    if ( queue_locked( client_socket, connection, std::make_shared<const std::string>( std::move( lines ) ) ) )
+        flush_locked( client_socket, connection );
+    if ( connection.closed )
+        throw std::runtime_error( "Failed to start session" );
+}
+
+void Server::expire_sessions( ) {
+    std::vector<std::string> expired = {};
+    {
+        const auto now = std::chrono::steady_clock::now( );
+        std::lock_guard<std::mutex> lock( session_mutex_ );
+        while ( !detached_.empty( ) && now - detached_.front( ).first >= resume_window ) {
+            const auto [ detached_at, token ] = std::move( detached_.front( ) );
+            detached_.pop_front( );
+
+            // Skip sessions that were resumed since, possibly detached again later
+            auto it = sessions_.find( token );
+            if ( it == sessions_.end( ) || it->second.socket != INVALID_SOCKET_VAL || it->second.detached_at != detached_at )
+                continue;
+            expired.push_back( std::move( it->second.username ) );
+            sessions_.erase( it );
+        }
+    }
+
+    // The user really left, announce it with the next presence delta
+    for ( const std::string& username : expired ) {
+        {
+            std::lock_guard<std::mutex> lock( presence_mutex_ );
+            presence_.leave( username );
+        }
+        std::cout << std::format( "[{}] Server: {} has disconnected.", Shared::get_current_time( ), username ) << std::endl;
+    }
+}
+
+void Server::accept_new_clients( ) {
+    // The listening socket is non-blocking, take every connection that is waiting
+    while ( !stopping_ ) {
+        socket_t client_socket = accept( server_socket_, nullptr, nullptr );
+        if ( client_socket == INVALID_SOCKET_VAL )
+            return;
+
+	    // Check if the maximum number of connections has been reached
+        {
+            std::lock_guard<std::mutex> lock( clients_mutex_ );
+            if ( clients_.size( ) >= FD_SETSIZE
+#ifndef _WIN32
+                 // select() can not watch descriptors past FD_SETSIZE, relay pipes use up numbers too
+                 || client_socket >= FD_SETSIZE
+#endif
+               ) {
+                std::cerr << "Too many connections." << std::endl;
+                CLOSESOCKET( client_socket );
+                continue;
+            }
+        }
+
+	    // Set the client socket to non-blocking mode
 #ifdef _WIN32
-    u_long mode = 1;
-    ioctlsocket( client_socket, FIONBIO, &mode );
+        u_long mode = 1;
+        ioctlsocket( client_socket, FIONBIO, &mode );
 #else
-    int flags = fcntl( client_socket, F_GETFL, 0 );
-    fcntl( client_socket, F_SETFL, flags | O_NONBLOCK );
+        int flags = fcntl( client_socket, F_GETFL, 0 );
+        fcntl( client_socket, F_SETFL, flags | O_NONBLOCK );
 #endif
 
-    // Add the new client to the master fd_set and socket tracking set
+        // Hand the loops new connections in turn, the receiving loop sets it up on its own thread
+        const std::size_t loop_index = next_loop_;
+        next_loop_ = ( next_loop_ + 1 ) % loops_.size( );
+        if ( loop_index == 0 ) {
+            adopt_client( 0, client_socket );
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock( loops_[ loop_index ].mutex );
+            loops_[ loop_index ].handed_off.push_back( client_socket );
+        }
+        wake( loops_[ loop_index ] );
+    }
+}
+
+void Server::adopt_client( std::size_t loop_index, socket_t client_socket ) {
+    auto connection = std::make_shared<Connection>( );
+    connection->loop = loop_index;
     {
         std::lock_guard<std::mutex> lock( clients_mutex_ );
-        clients_.insert( client_socket );
-        socket_set_.insert( client_socket );
-        FD_SET( client_socket, &master_set_ );
+        connection->id = next_connection_id_++;
+        if ( trace_ != nullptr )
+            trace_->record( Trace::EventKind::Connect, connection->id );
+        clients_.emplace( client_socket, connection );
     }
 
 	// Add the new client socket to the user map with an empty username
@@ -204,79 +781,368 @@ void Server::accept_new_client( ) {
 		std::lock_guard<std::mutex> lock( user_mutex_ );
         users_.insert( { client_socket, "" } );
     }
+
+    // Give the client a limited time to send its username
+    arm_timer( client_socket, *connection, TimerKind::Handshake, handshake_timeout );
+
+    // Start watching it, from the next select() on
+    EventLoop& loop = loops_[ loop_index ];
+    std::lock_guard<std::mutex> lock( loop.mutex );
+    loop.connections.emplace( client_socket, std::move( connection ) );
+    FD_SET( client_socket, &loop.master_set );
 }
 
-void Server::run( ) {
+void Server::wake( EventLoop& loop ) {
+    // One datagram is enough until the loop has woken up and cleared the flag
+    if ( !loop.woken.exchange( true ) )
+        send( loop.wakeup, "!", 1, 0 );
+}
+
+socket_t Server::open_wakeup_socket( ) {
+    // A loopback datagram socket connected to itself, Windows can only select() on sockets
+    socket_t wakeup = socket( AF_INET, SOCK_DGRAM, 0 );
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    inet_pton( AF_INET, "127.0.0.1", &address.sin_addr );
+    socklen_t length = sizeof( address );
+    if ( wakeup == INVALID_SOCKET_VAL || bind( wakeup, reinterpret_cast< sockaddr* >( &address ), sizeof( address ) ) != 0 ||
+         getsockname( wakeup, reinterpret_cast< sockaddr* >( &address ), &length ) != 0 ||
+         connect( wakeup, reinterpret_cast< sockaddr* >( &address ), sizeof( address ) ) != 0 ) {
+        if ( wakeup != INVALID_SOCKET_VAL )
+            CLOSESOCKET( wakeup );
+        throw std::runtime_error( std::format( "Could not create wake up socket: {}", GET_ERROR ) );
+    }
+
+    // Drained until it would block
+#ifdef _WIN32
+    u_long mode = 1;
+    ioctlsocket( wakeup, FIONBIO, &mode );
+#else
+    int flags = fcntl( wakeup, F_GETFL, 0 );
+    fcntl( wakeup, F_SETFL, flags | O_NONBLOCK );
+#endif
+    return wakeup;
+}
+
+void Server::arm_timer( socket_t client_socket, const Connection& connection, TimerKind kind, std::chrono::milliseconds delay ) {
+    std::lock_guard<std::mutex> lock( timer_mutex_ );
+    timers_.arm( client_socket, connection.id, kind, delay );
+}
+
+void Server::process_timers( ) {
+    // Collect every timer that expired since the last call
+    std::vector<TimingWheel::Expired> expired = {};
+    {
+        std::lock_guard<std::mutex> lock( timer_mutex_ );
+        timers_.advance( TimingWheel::clock::now( ), expired );
+    }
+
+    for ( const auto& [ client_socket, generation, kind ] : expired ) {
+        // Skip timers of clients that disconnected while the timer was pending,
+        // the socket may already belong to a new connection that this timer must not touch
+        std::shared_ptr<Connection> connection = find_connection( client_socket );
+        if ( connection == nullptr || connection->id != generation ) {
+            std::lock_guard<std::mutex> lock( timer_mutex_ );
+            timers_.remove( client_socket, generation );
+            continue;
+        }
+
+        // Look up the username for the disconnect message
+        std::string username = "";
+        {
+            std::lock_guard<std::mutex> lock( user_mutex_ );
+            if ( auto it = users_.find( client_socket ); it != users_.end( ) )
+                username = it->second;
+        }
+
+        switch ( kind ) {
+            case TimerKind::Handshake:
+                // The client never sent a username so it never joined, drop it silently
+                cleanup_client( client_socket, connection, username, true );
+#ifdef _DEBUG
+                std::cout << std::format( "[{}] Client disconnected: Handshake timed out", Shared::get_current_time( ) ) << std::endl;
+#endif
+                break;
+            case TimerKind::Idle:
+                // Ping the client and wait for any reply
+                if ( !send_to( client_socket, *connection, ping_flag ) ) {
+                    cleanup_client( client_socket, connection, username, false );
+                    break;
+                }
+                arm_timer( client_socket, *connection, TimerKind::PongDeadline, pong_timeout );
+                break;
+            case TimerKind::PongDeadline:
+                // The client did not answer the ping in time, reap the connection
+                cleanup_client( client_socket, connection, username, false );
+#ifdef _DEBUG
+                std::cout << std::format( "[{}] Client disconnected: Ping timed out", Shared::get_current_time( ) ) << std::endl;
+#endif
+                break;
+        }
+    }
+}
+
+void Server::record( const std::string& path ) {
+    trace_ = std::make_unique<Trace::Writer>( path );
+    std::cout << "Recording traffic to " << path << std::endl;
+}
+
+void Server::report_every( std::chrono::seconds interval ) {
+    report_interval_ = interval;
+    last_report_ = std::chrono::steady_clock::now( );
+}
+
+void Server::report_utilization( ) {
+    const auto now = std::chrono::steady_clock::now( );
+    const double window = static_cast< double >( std::chrono::duration_cast< std::chrono::nanoseconds >( now - last_report_ ).count( ) );
+    std::string report = std::format( "[{}] Utilization over the last {:.1f} s:\n", Shared::get_current_time( ), window / 1e9 );
+
+    std::lock_guard<std::mutex> lock( Shared::stats_mutex_ );
+    last_counters_.resize( Shared::thread_stats_.size( ) );
+    for ( std::size_t i = 0; i < Shared::thread_stats_.size( ); ++i ) {
+        const Shared::ThreadStats& stats = Shared::thread_stats_[ i ];
+        const std::uint64_t busy = stats.busy_ns.load( std::memory_order_relaxed );
+        const std::uint64_t tasks = stats.tasks.load( std::memory_order_relaxed );
+        auto& [ last_busy, last_tasks ] = last_counters_[ i ];
+
+        report.append( std::format( "  {:<14} {:<10} {:5.1f}% busy {:>10} tasks\n", stats.name, stats.cpu < 0 ? std::string( "unpinned" ) : std::format( "cpu {}", stats.cpu ),
+                                    100.0 * static_cast< double >( busy - last_busy ) / window, tasks - last_tasks ) );
+        last_busy = busy;
+        last_tasks = tasks;
+    }
+    last_report_ = now;
+    std::cout << report << std::flush;
+}
+
+void Server::flush_presence( ) {
+    std::optional<Presence::Delta> delta = {};
+    {
+        std::lock_guard<std::mutex> lock( presence_mutex_ );
+        delta = presence_.take_delta( Presence::clock::now( ), presence_window );
+    }
+
+    // One line for everyone no matter how many users joined or left, more only once the names need them, sent
+    // off the select thread. Users that just joined are left out of their own announcement, a line that only
+    // announced them becomes its bare sequence number.
+    if ( delta.has_value( ) ) {
+        Shared::post_task( [ this, delta = std::move( *delta ) ] {
+            for ( std::size_t i = 0; i < delta.lines.size( ); ++i ) {
+                std::unordered_map<socket_t, std::string> own = {};
+                for ( const auto& [ socket, lines ] : delta.own )
+                    own.emplace( socket, i < lines.size( ) ? lines[ i ] : std::string( ) );
+                broadcast( delta.lines[ i ], INVALID_SOCKET_VAL, own );
+            }
+        }, loops_[ 0 ].placement.queue );
+    }
+}
+
+void Server::run( const Topology::Layout& layout ) {
+    // Only the first loop watches the listening socket, every loop watches its wake up socket
+    for ( std::size_t i = 0; i < layout.event_loops.size( ); ++i ) {
+        EventLoop& loop = loops_.emplace_back( );
+        loop.placement = layout.event_loops[ i ];
+        loop.stats = &Shared::register_thread( std::format( "event loop {}", i ), loop.placement );
+        loop.wakeup = open_wakeup_socket( );
+        FD_ZERO( &loop.master_set );
+        FD_SET( loop.wakeup, &loop.master_set );
+        if ( i == 0 )
+            FD_SET( server_socket_, &loop.master_set );
+    }
+
 	// Indicate what ip and port the server is listening on
     std::cout << "Server listening on " << ip << ":" << port << std::endl;
 
-    while ( true ) {
+    // The first loop runs on the calling thread, the others get threads of their own
+    std::vector<std::jthread> threads = {};
+    for ( std::size_t i = 1; i < loops_.size( ); ++i )
+        threads.emplace_back( [ this, i ] { run_loop( i ); } );
+    run_loop( 0 );
+}
+
+void Server::run_loop( std::size_t loop_index ) {
+    EventLoop& loop = loops_[ loop_index ];
+    Topology::pin_current_thread( loop.placement.cpu );
+
+    auto woke = std::chrono::steady_clock::now( );
+    while ( !stopping_ ) {
+        // Everything since select() last returned counts as busy
+        loop.stats->busy_ns.fetch_add( static_cast< std::uint64_t >( std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now( ) - woke ).count( ) ), std::memory_order_relaxed );
+
         fd_set read_set = {};
+        fd_set write_set = {};
         FD_ZERO( &read_set );
-        socket_t max_fd = 0;
+        FD_ZERO( &write_set );
+        bool any_writes = false;
+        socket_t max_fd = loop_index == 0 ? std::max( loop.wakeup, server_socket_ ) : loop.wakeup;
 
         {
-            std::lock_guard<std::mutex> lock( clients_mutex_ );
-            // Copy master_set_ to read_set
-            read_set = master_set_;
-            // Find max_fd from socket_set_
-            for ( socket_t s : socket_set_ ) {
+            std::lock_guard<std::mutex> lock( loop.mutex );
+            // Copy the master set to read_set
+            read_set = loop.master_set;
+            // Find max_fd from the loops sockets, and watch the ones with a backed up outbox for room to write
+            for ( const auto& [ s, connection ] : loop.connections ) {
                 if ( s > max_fd ) max_fd = s;
+                if ( connection->paused )
+                    FD_CLR( s, &read_set );
+                if ( connection->want_write ) {
+                    FD_SET( s, &write_set );
+                    any_writes = true;
+                }
             }
         }
 
 		// Set the number of file descriptors to monitor
         int nfds = static_cast<int>( max_fd ) + 1;
 
+        // Wake up at least once per timer tick so deadlines are serviced without traffic
+        timeval timeout = {};
+        timeout.tv_sec = static_cast< long >( timer_tick.count( ) / 1000 );
+        timeout.tv_usec = static_cast< long >( ( timer_tick.count( ) % 1000 ) * 1000 );
+
 		// Use select to wait for activity on the sockets
-        int ready_count = select( nfds, &read_set, nullptr, nullptr, nullptr );
+        int ready_count = select( nfds, &read_set, any_writes ? &write_set : nullptr, nullptr, &timeout );
+        woke = std::chrono::steady_clock::now( );
 
 		// Check if select returned an error
         if ( ready_count == SOCKET_ERROR ) {
-            std::cerr << "select() failed: " << GET_ERROR << std::endl;
+            // A worker closed one of the sockets after the set was copied, the next copy no longer has it
+            const int err = GET_ERROR;
+            if ( err == EINTR_ERR || err == BAD_SOCKET_ERR )
+                continue;
+            std::cerr << "select() failed: " << err << std::endl;
+            // Take the other loops down too
+            stopping_ = true;
             break;
         }
 
+        // Server wide housekeeping is done by the first loop only
+        if ( loop_index == 0 ) {
+            // Fire handshake deadlines, heartbeats and idle reaping
+            process_timers( );
+
+            // Give up on sessions that were not resumed in time, then announce the joins and leaves of the last window
+            expire_sessions( );
+            flush_presence( );
+
+            // Keep the trace on disk reasonably current, the write happens on a worker
+            if ( trace_ != nullptr && woke - last_trace_flush_ >= trace_flush_interval ) {
+                last_trace_flush_ = woke;
+                Shared::post_task( [ this ] { trace_->flush( ); }, loop.placement.queue );
+            }
+
+            if ( report_interval_.count( ) > 0 && woke - last_report_ >= report_interval_ )
+                report_utilization( );
+        }
+
+        // Nothing else to do if select only timed out
+        if ( ready_count == 0 )
+            continue;
+
+        // Clear the flag before draining, a wake up sent after this is noticed on the next select()
+        if ( FD_ISSET( loop.wakeup, &read_set ) ) {
+            loop.woken = false;
+            char drain[ 64 ] = {};
+            while ( recv( loop.wakeup, drain, sizeof( drain ), 0 ) > 0 ) { }
+        }
+
+        // Only the first loop accepts, the other loops get the sockets handed over
+        if ( loop_index == 0 && FD_ISSET( server_socket_, &read_set ) )
+            accept_new_clients( );
+
 		// Vector to hold the ready sockets
-        std::vector<socket_t> ready_sockets = {};
+        std::vector<std::pair<socket_t, std::shared_ptr<Connection>>> ready_clients = {};
+        std::vector<std::pair<socket_t, std::shared_ptr<Connection>>> writable_clients = {};
+        std::vector<socket_t> handed_off = {};
 
 		// Reserve space for the ready sockets to avoid multiple allocations
-        ready_sockets.reserve( socket_set_.size( ) );
+        ready_clients.reserve( static_cast< std::size_t >( ready_count ) );
         {
 			// Add the ready sockets to the vector
-            std::lock_guard<std::mutex> lock( clients_mutex_ );
-            for ( socket_t s : socket_set_ ) {
+            std::lock_guard<std::mutex> lock( loop.mutex );
+            handed_off.swap( loop.handed_off );
+            for ( const auto& [ s, connection ] : loop.connections ) {
 				// Check if the socket is ready for reading if it is then client is ready
                 if ( FD_ISSET( s, &read_set ) ) {
-                    ready_sockets.push_back( s );
+                    ready_clients.emplace_back( s, connection );
                 }
+                // The flush sets the flag again if the socket fills up before the outbox is empty
+                if ( any_writes && FD_ISSET( s, &write_set ) && connection->want_write.exchange( false ) )
+                    writable_clients.emplace_back( s, connection );
             }
         }
+        loop.stats->tasks.fetch_add( ready_clients.size( ) + writable_clients.size( ), std::memory_order_relaxed );
 
-		// Iterate over the ready sockets and handle them
-        for ( socket_t s : ready_sockets ) {
-			// Check if the socket is the server socket
-            if ( s == server_socket_ ) {
-				// Accept a new client connection
-                accept_new_client( );
-            }
-            else {
-				// Send handle_client task to the thread pool
-                Shared::post_task( [ this, s ] {
-                    handle_client( s );
-                } );
-            }
+        // Set up the connections handed over by the first loop, they are watched from the next select() on
+        for ( socket_t s : handed_off )
+            adopt_client( loop_index, s );
+
+		// Send handle_client tasks to the workers on the loops node
+        for ( auto& [ s, connection ] : ready_clients ) {
+            Shared::post_task( [ this, s, connection = std::move( connection ) ] {
+                handle_client( s, connection );
+            }, loop.placement.queue );
+        }
+        for ( auto& [ s, connection ] : writable_clients ) {
+            Shared::post_task( [ this, s, connection = std::move( connection ) ] {
+                flush_client( s, connection );
+            }, loop.placement.queue );
         }
     }
 }
 
-int main( ) {
+int main( int argc, char* argv[ ] ) {
     try {
-        // Start multithreading
-        Shared::start_mt( );
+#ifndef _WIN32
+        // A peer closing mid send must not kill the server, splice() has no MSG_NOSIGNAL
+        signal( SIGPIPE, SIG_IGN );
+#endif
+        const std::string usage = std::format( "Usage: {} [--record <trace file>] [--event-loops <count>] [--workers <count>] [--cpus <list>] [--no-pin] [--stats <seconds>]", argv[ 0 ] );
 
-        // Run the Server
-        Server( ).run( );
+        std::string trace_path = {};
+        unsigned int event_loops = 1, workers = 0, stats_seconds = 0;
+        std::optional<std::vector<int>> cpus = {};
+        bool pin = true;
+        for ( int i = 1; i < argc; ++i ) {
+            const std::string_view option = argv[ i ];
+            if ( option == "--no-pin" ) {
+                pin = false;
+                continue;
+            }
+            if ( i + 1 == argc )
+                throw std::runtime_error( usage );
+
+            const std::string_view value = argv[ ++i ];
+            if ( option == "--record" )
+                trace_path = value;
+            else if ( option == "--cpus" )
+                cpus = Topology::parse_cpu_list( value );
+            else if ( !( ( option == "--event-loops" && Shared::parse_number( value, event_loops ) && event_loops > 0 ) ||
+                         ( option == "--workers" && Shared::parse_number( value, workers ) ) ||
+                         ( option == "--stats" && Shared::parse_number( value, stats_seconds ) ) ) )
+                throw std::runtime_error( usage );
+        }
+
+        // Restrict the machine to the CPUs asked for, then place the event loops and workers on it
+        std::vector<Topology::Node> nodes = Topology::detect( );
+        if ( cpus.has_value( ) ) {
+            for ( Topology::Node& node : nodes )
+                std::erase_if( node.cpus, [ & ]( int cpu ) { return std::find( cpus->begin( ), cpus->end( ), cpu ) == cpus->end( ); } );
+            std::erase_if( nodes, [ ]( const Topology::Node& node ) { return node.cpus.empty( ); } );
+            if ( nodes.empty( ) )
+                throw std::runtime_error( "None of the CPUs given with --cpus are available" );
+        }
+        const Topology::Layout layout = pin ? Topology::plan( nodes, event_loops, workers ) : Topology::unpinned( event_loops, workers > 0 ? workers : max_threads );
+        std::cout << Topology::describe( nodes, layout );
+
+        Server server = {};
+        if ( !trace_path.empty( ) )
+            server.record( trace_path );
+        if ( stats_seconds > 0 )
+            server.report_every( std::chrono::seconds( stats_seconds ) );
+
+        // Start multithreading
+        Shared::start_mt( layout );
+        server.run( layout );
     }
     catch ( const std::exception& e ) {
         std::cerr << "Exception: " << e.what( ) << std::endl;
@@ -284,4 +1150,4 @@ int main( ) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
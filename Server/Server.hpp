@@ -1,22 +1,169 @@
 #pragma once
 #include "../Shared.hpp"
+#include "../Compress.hpp"
+#include "../Sanitize.hpp"
+#include "../Trace.hpp"
+#include "Outbox.hpp"
+#include "Presence.hpp"
+#include "Relay.hpp"
+#include "TimingWheel.hpp"
 
-#include <unordered_set>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <random>
+#include <unordered_map>
 
 // Will set to the ip of the machine running the server
 constexpr static const char* ip = "0.0.0.0";
 
+// Resolution of the connection timers, also the longest select() will block
+constexpr static const std::chrono::milliseconds timer_tick = std::chrono::milliseconds( 100 );
+// How long a new connection has to send its username
+constexpr static const std::chrono::milliseconds handshake_timeout = std::chrono::seconds( 10 );
+// How long a logged in client may stay silent before it is pinged
+constexpr static const std::chrono::milliseconds idle_timeout = std::chrono::seconds( 30 );
+// How long a pinged client has to answer before it is disconnected
+constexpr static const std::chrono::milliseconds pong_timeout = std::chrono::seconds( 10 );
+// Joins and leaves within this window are announced together in one line
+constexpr static const std::chrono::milliseconds presence_window = std::chrono::milliseconds( 250 );
+// How long a dropped client can resume its session, its leave is announced once this has passed
+constexpr static const std::chrono::milliseconds resume_window = std::chrono::seconds( 20 );
+// Broadcasts kept for resumed sessions, the oldest are dropped once either limit is reached
+constexpr static const std::size_t history_length = 512;
+constexpr static const std::size_t history_bytes = 256 * 1024;
+// A partly filled trace buffer is written out this often, full ones go out as soon as they fill
+constexpr static const std::chrono::milliseconds trace_flush_interval = std::chrono::seconds( 1 );
+
+// Login that outlives its connection so a reconnecting client can pick up where it left off
+struct Session {
+    std::string username = {};
+    // Connection using the session, invalid while the client is away
+    socket_t socket = INVALID_SOCKET_VAL;
+    std::chrono::steady_clock::time_point detached_at = {};
+};
+
+// Broadcast kept for clients that resume their session
+struct HistoryEntry {
+    std::uint64_t sequence = 0;
+    // Session of the sender, its own messages are not replayed to it
+    std::string origin = {};
+    // Framed line exactly as it was broadcast
+    std::string line = {};
+};
+
+struct Connection;
+
+// File transfer a client is currently sending
+struct Upload {
+    std::uint64_t id = 0;
+    std::string name = {};
+    // Receiving connection, empty while a rejected or abandoned transfer is drained
+    std::weak_ptr<Connection> recipient = {};
+    socket_t recipient_socket = INVALID_SOCKET_VAL;
+    std::string recipient_name = {};
+    // File bytes not received yet
+    std::uint64_t remaining = 0;
+    // Payload bytes left in the current data frame
+    std::uint64_t frame_remaining = 0;
+    std::unique_ptr<Relay> relay = {};
+};
+
+// Per connection state shared between the worker threads
+struct Connection {
+    // Identifies the connection in traces and timers, unlike the socket it is never reused
+    std::uint64_t id = 0;
+    // Session token and whether broadcasts are sent to the connection yet, both guarded by the servers history_mutex_
+    std::string session = {};
+    bool ready = false;
+    // Broadcasts go out as compressed frames, agreed on during the handshake so set before ready
+    bool compressed = false;
+    // Event loop watching the socket
+    std::size_t loop = 0;
+    // Only one worker parses a connection at a time
+    std::mutex read_mutex = {};
+    // Keeps lines and data frames sent to this connection from interleaving, guards closed and the outbox
+    std::mutex write_mutex = {};
+    // Set once a send failed or the socket is about to be closed, nothing is queued or written after that
+    bool closed = false;
+    Outbox outbox = {};
+    // The event loop watches the socket for writability while set. Set with a non-empty outbox, cleared by the loop.
+    std::atomic<bool> want_write = false;
+    // The event loop stops reading the socket while set, the file it sends waits for its receiver to catch up
+    std::atomic<bool> paused = false;
+    // Senders paused on this connection as their receiver, resumed once the outbox drained
+    std::vector<std::pair<socket_t, std::weak_ptr<Connection>>> paused_senders = {};
+    // Inbound line that has not been completed yet
+    std::string line = {};
+    // Long message being reassembled from chunks
+    std::string chunks = {};
+    std::optional<Upload> upload = {};
+};
+
+// A select() loop and the connections it watches. Only the first loop watches the listening socket, it hands
+// every new socket to the loops in turn. The receiving loop sets the connection up on its own thread, so it is
+// allocated and handled on the NUMA node of that loop.
+struct EventLoop {
+    // Guards the connections, the master set and the handed off sockets
+    std::mutex mutex = {};
+    std::unordered_map<socket_t, std::shared_ptr<Connection>> connections = {};
+    fd_set master_set = {};
+    std::vector<socket_t> handed_off = {};
+    // Datagram socket connected to itself, whatever is sent to it wakes the loop from select()
+    socket_t wakeup = INVALID_SOCKET_VAL;
+    // Set while a wake up is pending so a busy loop is not sent a datagram per event
+    std::atomic<bool> woken = false;
+    Topology::Thread placement = {};
+    Shared::ThreadStats* stats = nullptr;
+};
+
 class Server {
 private:
     socket_t server_socket_ = {};
-    std::unordered_set<socket_t> clients_ = {};
-    std::unordered_set<socket_t> socket_set_ = {};
+    // Every connection by socket for lookups, the event loops keep their own connections
+    std::unordered_map<socket_t, std::shared_ptr<Connection>> clients_ = {};
     std::unordered_map<socket_t, std::string> users_ = {};
 
     std::mutex clients_mutex_ = {};
     std::mutex user_mutex_ = {};
 
-    fd_set master_set_ = {};
+    TimingWheel timers_{ timer_tick };
+    std::mutex timer_mutex_ = {};
+
+    Presence presence_ = {};
+    std::mutex presence_mutex_ = {};
+
+    // Sessions by token and the order in which they were detached, which is also the order they expire in
+    std::unordered_map<std::string, Session> sessions_ = {};
+    std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>> detached_ = {};
+    std::mutex session_mutex_ = {};
+
+    // Recent broadcasts and the next sequence number, held while a broadcast goes out so numbering matches send order
+    std::deque<HistoryEntry> history_ = {};
+    std::size_t history_size_ = 0;
+    std::uint64_t next_sequence_ = 1;
+    std::mutex history_mutex_ = {};
+    // Whether the last broadcast reached a client that asked for compression, the next one is compressed ahead of time if so
+    std::atomic<bool> compress_broadcasts_ = false;
+
+    std::atomic<std::uint64_t> next_transfer_id_ = 1;
+    std::uint64_t next_connection_id_ = 1;
+
+    // Records inbound traffic when a trace file was given
+    std::unique_ptr<Trace::Writer> trace_ = {};
+    std::chrono::steady_clock::time_point last_trace_flush_ = {};
+
+    // Created once by run, each guarded by its own mutex
+    std::deque<EventLoop> loops_ = {};
+    std::atomic<bool> stopping_ = false;
+    // Loop the next accepted socket goes to, only used by the first loop
+    std::size_t next_loop_ = 0;
+
+    // Utilization is printed this often when set, with the counters at the previous report
+    std::chrono::seconds report_interval_ = {};
+    std::chrono::steady_clock::time_point last_report_ = {};
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> last_counters_ = {};
 public:
     Server( ) {
 #ifdef _WIN32
@@ -38,6 +185,12 @@ public:
             throw std::runtime_error( "Could not create socket" );
         }
 
+#ifndef _WIN32
+        // Let a restarted server bind right away instead of waiting for the old connections to leave TIME_WAIT
+        int reuse = 1;
+        setsockopt( server_socket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+#endif
+
 		// Set up the server address structure
         sockaddr_in server_addr = {};
         server_addr.sin_family = AF_INET;
@@ -87,11 +240,6 @@ public:
         int flags = fcntl( server_socket_, F_GETFL, 0 );
         fcntl( server_socket_, F_SETFL, flags | O_NONBLOCK );
 #endif
-
-		// Initialize the master set for select and add the server socket to the socket set
-        FD_ZERO( &master_set_ );
-        FD_SET( server_socket_, &master_set_ );
-        socket_set_.insert( server_socket_ );
     }
 
     ~Server( ) {
@@ -101,15 +249,48 @@ public:
         shutdown( server_socket_, SD_BOTH );
         // Close the client socket
         CLOSESOCKET( server_socket_ );
+        for ( EventLoop& loop : loops_ ) {
+            if ( loop.wakeup != INVALID_SOCKET_VAL )
+                CLOSESOCKET( loop.wakeup );
+        }
 #ifdef _WIN32
         // Cleanup Winsock
         WSACleanup( );
 #endif
     }
 private:
-    void cleanup_client( socket_t client_socket, std::string username, bool http_request );
-    void handle_client( socket_t client_socket );
-    void accept_new_client( );
+    void cleanup_client( socket_t client_socket, const std::shared_ptr<Connection>& expected, std::string username, bool silent );
+    void handle_client( socket_t client_socket, const std::shared_ptr<Connection>& connection );
+    void handle_line( socket_t client_socket, Connection& connection, const std::string& username, std::string_view line );
+    void start_upload( socket_t client_socket, Connection& connection, const std::string& username, std::string_view header );
+    int relay_upload( socket_t client_socket, Connection& connection, std::size_t budget );
+    bool pause_upload( socket_t client_socket, const std::shared_ptr<Connection>& connection );
+    void resume_senders_locked( Connection& connection );
+    std::shared_ptr<Connection> find_connection( socket_t client_socket );
+    bool send_to( socket_t client_socket, Connection& connection, std::string_view text );
+    bool queue_locked( socket_t client_socket, Connection& connection, std::shared_ptr<const std::string> data );
+    void flush_locked( socket_t client_socket, Connection& connection );
+    void fail_locked( socket_t client_socket, Connection& connection );
+    void flush_client( socket_t client_socket, const std::shared_ptr<Connection>& connection );
+    void broadcast( std::string_view message, socket_t except, const std::unordered_map<socket_t, std::string>& own = {} );
+    void accept_new_clients( );
+    void adopt_client( std::size_t loop_index, socket_t client_socket );
+    void wake( EventLoop& loop );
+    static socket_t open_wakeup_socket( );
+    void arm_timer( socket_t client_socket, const Connection& connection, TimerKind kind, std::chrono::milliseconds delay );
+    void process_timers( );
+    void flush_presence( );
+    std::string create_session( socket_t client_socket, const std::string& username );
+    std::string resume_session( socket_t client_socket, const std::string& token );
+    void start_session( socket_t client_socket, Connection& connection, const std::string& token, std::optional<std::uint64_t> resume_after );
+    void expire_sessions( );
+    void run_loop( std::size_t loop_index );
+    void report_utilization( );
 public:
-    void run( );
+    // Record every connection and inbound message to path, must be called before run
+    void record( const std::string& path );
+    // Print the utilization of every thread once per interval, must be called before run
+    void report_every( std::chrono::seconds interval );
+    // Serve with one event loop per entry in the layout, the workers must already be started with the same layout
+    void run( const Topology::Layout& layout );
 };
@@ -0,0 +1,157 @@
+#pragma once
+#include "../Shared.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Kind of deadline a connection is currently waiting on
+enum class TimerKind : std::uint8_t {
+    Handshake,      // Client connected but has not sent a username yet
+    Idle,           // Client is logged in, a ping is sent when this expires
+    PongDeadline    // Ping was sent, the client is reaped if this expires
+};
+
+// Hierarchical timing wheel holding at most one timer per socket.
+// Arming, re-arming and cancelling are O(1), expiry is amortized O(1) per timer.
+// Socket numbers are reused, so every timer also carries the generation of the connection that armed it.
+// Generations only grow: a call with an older generation than the socket's timer comes from a closed connection and is ignored.
+class TimingWheel {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct Expired {
+        socket_t socket;
+        std::uint64_t generation;
+        TimerKind kind;
+    };
+private:
+    constexpr static const int slot_bits = 6;
+    constexpr static const std::uint64_t slots_per_level = 1ULL << slot_bits;
+    constexpr static const std::uint64_t slot_mask = slots_per_level - 1;
+    constexpr static const int levels = 4;
+    // Largest delay (in ticks) the wheel can represent, longer delays are clamped
+    constexpr static const std::uint64_t max_ticks = ( 1ULL << ( slot_bits * levels ) ) - 1;
+
+    // Intrusive list node, also used as the sentinel head of every slot
+    struct Node {
+        Node* prev = nullptr;
+        Node* next = nullptr;
+        std::uint64_t expires = 0;
+        socket_t socket = {};
+        std::uint64_t generation = 0;
+        TimerKind kind = TimerKind::Handshake;
+    };
+
+    std::chrono::milliseconds tick_ = {};
+    clock::time_point start_ = {};
+    std::uint64_t current_tick_ = 0;
+    std::array<std::array<Node, slots_per_level>, levels> wheel_ = {};
+    // unordered_map keeps node addresses stable across rehashes
+    std::unordered_map<socket_t, Node> nodes_ = {};
+public:
+    explicit TimingWheel( std::chrono::milliseconds tick, clock::time_point now = clock::now( ) )
+        : tick_( tick ), start_( now ) {
+        // Every slot starts out as an empty circular list
+        for ( auto& level : wheel_ ) {
+            for ( Node& head : level ) {
+                head.prev = &head;
+                head.next = &head;
+            }
+        }
+    }
+
+    TimingWheel( const TimingWheel& ) = delete;
+    TimingWheel& operator=( const TimingWheel& ) = delete;
+
+    std::chrono::milliseconds tick( ) const { return tick_; }
+
+    // Arm (or re-arm) the timer for a socket, replacing whatever it was waiting on
+    void arm( socket_t socket, std::uint64_t generation, TimerKind kind, std::chrono::milliseconds delay ) {
+        Node& node = nodes_[ socket ];
+        if ( node.generation > generation )
+            return;
+        if ( node.next != nullptr )
+            unlink( node );
+
+        // Round up so a timer never fires early, and always at least one tick in the future
+        const std::uint64_t ticks = static_cast< std::uint64_t >( ( delay + tick_ - std::chrono::milliseconds( 1 ) ) / tick_ );
+        node.expires = current_tick_ + std::clamp<std::uint64_t>( ticks, 1, max_ticks );
+        node.socket = socket;
+        node.generation = generation;
+        node.kind = kind;
+        link( node );
+    }
+
+    // Stop the timer for a socket but keep its node around for the next arm
+    void cancel( socket_t socket, std::uint64_t generation ) {
+        if ( auto it = nodes_.find( socket ); it != nodes_.end( ) && it->second.generation <= generation && it->second.next != nullptr )
+            unlink( it->second );
+    }
+
+    // Forget a socket entirely, called once the connection is closed
+    void remove( socket_t socket, std::uint64_t generation ) {
+        if ( auto it = nodes_.find( socket ); it != nodes_.end( ) && it->second.generation <= generation ) {
+            if ( it->second.next != nullptr )
+                unlink( it->second );
+            nodes_.erase( it );
+        }
+    }
+
+    // Advance the wheel up to now, appending every timer that fired to expired
+    void advance( clock::time_point now, std::vector<Expired>& expired ) {
+        const std::uint64_t target = static_cast< std::uint64_t >( ( now - start_ ) / tick_ );
+        while ( current_tick_ < target ) {
+            ++current_tick_;
+
+            // When a lower level wraps, pull the matching slot of the level above down
+            for ( int level = 1; level < levels; ++level ) {
+                if ( ( ( current_tick_ >> ( slot_bits * ( level - 1 ) ) ) & slot_mask ) != 0 )
+                    break;
+                cascade( level );
+            }
+
+            // Everything left in the current level 0 slot is due
+            Node& head = wheel_[ 0 ][ current_tick_ & slot_mask ];
+            while ( head.next != &head ) {
+                Node& node = *head.next;
+                unlink( node );
+                expired.push_back( { node.socket, node.generation, node.kind } );
+            }
+        }
+    }
+private:
+    void link( Node& node ) {
+        const std::uint64_t delta = node.expires - current_tick_;
+
+        // Pick the lowest level whose span still covers the remaining delay
+        int level = 0;
+        while ( level < levels - 1 && delta >= ( 1ULL << ( slot_bits * ( level + 1 ) ) ) )
+            ++level;
+
+        Node& head = wheel_[ level ][ ( node.expires >> ( slot_bits * level ) ) & slot_mask ];
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+    }
+
+    static void unlink( Node& node ) {
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = nullptr;
+        node.next = nullptr;
+    }
+
+    // Re-insert every node of the current slot at the given level relative to the new tick
+    void cascade( int level ) {
+        Node& head = wheel_[ level ][ ( current_tick_ >> ( slot_bits * level ) ) & slot_mask ];
+        while ( head.next != &head ) {
+            Node& node = *head.next;
+            unlink( node );
+            link( node );
+        }
+    }
+};
@@ -1,3 +1,4 @@
+#pragma once
 #include <iostream>
 #include <thread>
 #include <chrono>
@@ -7,6 +8,14 @@
 #include <queue>
 #include <condition_variable>
 #include <cstring>
+#include <charconv>
+#include <climits>
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <limits>
+#include <string_view>
+#include <vector>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -18,9 +27,13 @@ using socket_t = SOCKET;
 #define INVALID_SOCKET_VAL INVALID_SOCKET
 #define WOULD_BLOCK WSAEWOULDBLOCK
 #define EINTR_ERR WSAEINTR
+#define BAD_SOCKET_ERR WSAENOTSOCK
+#define SEND_FLAGS 0
 #else
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <arpa/inet.h>
+#include <csignal>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -32,22 +45,81 @@ using socket_t = int;
 #define SD_BOTH SHUT_RDWR
 #define WOULD_BLOCK EWOULDBLOCK
 #define EINTR_ERR EINTR
+#define BAD_SOCKET_ERR EBADF
 #define SOCKET_ERROR -1
+// Report a closed peer as an error instead of raising SIGPIPE
+#define SEND_FLAGS MSG_NOSIGNAL
 #endif
 
+#include "Topology.hpp"
+
 constexpr static const int port = 12345;
 constexpr static const int max_username_length = 32;
 constexpr static const int max_message_length = 1036;
 constexpr static const std::string_view message_flag = "[ MESSAGE ] ";
+constexpr static const std::string_view ping_flag = "[ PING ]";
+constexpr static const std::string_view pong_flag = "[ PONG ]";
+// Part of a message too long for one line, the final part is sent with message_flag
+constexpr static const std::string_view chunk_flag = "[ CHUNK ] ";
+// Announces a file transfer, followed by data frames until the whole file is sent
+constexpr static const std::string_view file_flag = "[ FILE ] ";
+// Header of a binary frame, the payload follows the line delimiter
+constexpr static const std::string_view data_flag = "[ DATA ] ";
+// A file transfer was aborted
+constexpr static const std::string_view cancel_flag = "[ CANCEL ] ";
+// Users that joined and left recently, the counts followed by the names prefixed with + or -
+constexpr static const std::string_view presence_flag = "[ PRESENCE ] ";
+// Request for everyone online, answered with the count followed by the names
+constexpr static const std::string_view roster_flag = "[ ROSTER ]";
+// Sequence number of a broadcast followed by the line itself, only the number for the sender of a message
+constexpr static const std::string_view sequence_flag = "[ SEQ ] ";
+// Token the server hands out after login, used to resume the session after a reconnect
+constexpr static const std::string_view session_flag = "[ SESSION ] ";
+// Sent instead of the username by a reconnecting client, followed by the token, last sequence number and username
+constexpr static const std::string_view resume_flag = "[ RESUME ] ";
+// Sent before the username by a client that can inflate frames, followed by the codec name
+constexpr static const std::string_view compress_flag = "[ COMPRESS ] ";
+// Header of a compressed frame holding complete lines, the compressed bytes follow the line delimiter
+constexpr static const std::string_view deflate_flag = "[ DEFLATE ] ";
+// Every message is a single line, fields inside a line are tab separated
+constexpr static const char line_delimiter = '\n';
+constexpr static const char field_separator = '\t';
+// Largest message that can be reassembled from chunks
+constexpr static const std::size_t max_stream_length = 64 * 1024;
+// Largest file that can be transferred
+constexpr static const std::uint64_t max_file_size = 4ULL * 1024 * 1024 * 1024;
+// Payload size of the data frames a client sends
+constexpr static const std::size_t file_slice_length = 16 * 1024;
+// How long a send may wait for a slow receiver before the connection counts as dead
+constexpr static const std::chrono::milliseconds send_timeout = std::chrono::seconds( 5 );
 constexpr static const int HTTP_DETECTED = std::numeric_limits<int>::min( );
+constexpr static const int LINE_TOO_LONG = HTTP_DETECTED + 1;
 static const unsigned int max_threads = std::max( 1u, std::thread::hardware_concurrency( ) );
 
 namespace Shared {
+    // Tasks for the workers of one NUMA node
+    struct TaskQueue {
+        std::queue<std::function<void( )>> tasks = {};
+        std::condition_variable cv = {};
+        std::mutex mutex = {};
+        bool shutting_down = false;
+    };
+
+    // Utilization counters of a pool worker or event loop thread
+    struct ThreadStats {
+        std::string name = {};
+        int cpu = -1;
+        int node = -1;
+        // Time spent running tasks, or for an event loop outside of select()
+        std::atomic<std::uint64_t> busy_ns = 0;
+        std::atomic<std::uint64_t> tasks = 0;
+    };
+
     inline std::vector<std::jthread> thread_pool_;
-    inline std::queue<std::function<void( )>> task_queue_;
-    inline std::condition_variable task_cv_;
-    inline std::mutex task_mutex_;
-    inline bool shutting_down_ = false;
+    // Deques so the threads can hold on to their queue and counters while more are added
+    inline std::deque<TaskQueue> task_queues_;
+    inline std::deque<ThreadStats> thread_stats_;
+    inline std::mutex stats_mutex_;
 
 	// Helper function to get the current time as a string
     inline std::string get_current_time( ) {
@@ -69,40 +141,68 @@ namespace Shared {
 		return ss.str( );
 	}
 
-    inline void worker_thread( ) {
+    inline ThreadStats& register_thread( std::string name, const Topology::Thread& placement ) {
+        std::lock_guard<std::mutex> lock( stats_mutex_ );
+        ThreadStats& stats = thread_stats_.emplace_back( );
+        stats.name = std::move( name );
+        stats.cpu = placement.cpu;
+        stats.node = placement.node;
+        return stats;
+    }
+
+    inline void worker_thread( TaskQueue& queue, ThreadStats& stats ) {
+        // Pin before anything is allocated so the workers memory ends up on its own node
+        Topology::pin_current_thread( stats.cpu );
+
         while ( true ) {
             std::function<void( )> task;
             {
-                std::unique_lock<std::mutex> lock( task_mutex_ );
-                task_cv_.wait( lock, [ & ] { return shutting_down_ || !task_queue_.empty( ); } );
-                if ( shutting_down_ && task_queue_.empty( ) ) return;
-                task = std::move( task_queue_.front( ) );
-                task_queue_.pop( );
+                std::unique_lock<std::mutex> lock( queue.mutex );
+                queue.cv.wait( lock, [ & ] { return queue.shutting_down || !queue.tasks.empty( ); } );
+                if ( queue.shutting_down && queue.tasks.empty( ) ) return;
+                task = std::move( queue.tasks.front( ) );
+                queue.tasks.pop( );
             }
+
+            const auto start = std::chrono::steady_clock::now( );
             task( );
+            stats.busy_ns.fetch_add( static_cast< std::uint64_t >( std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now( ) - start ).count( ) ), std::memory_order_relaxed );
+            stats.tasks.fetch_add( 1, std::memory_order_relaxed );
         }
     }
 
-    inline void post_task( std::function<void( )> task ) {
+    // Queue 0 unless the layout has one per node, an event loop posts to the queue of its own node
+    inline void post_task( std::function<void( )> task, std::size_t queue_index = 0 ) {
+        TaskQueue& queue = task_queues_[ std::min( queue_index, task_queues_.size( ) - 1 ) ];
         {
-            std::lock_guard<std::mutex> lock( task_mutex_ );
-            task_queue_.emplace( std::move( task ) );
+            std::lock_guard<std::mutex> lock( queue.mutex );
+            queue.tasks.emplace( std::move( task ) );
+        }
+        queue.cv.notify_one( );
+    }
+
+    // Start the workers of every queue in the layout, each pinned where the layout says
+    inline void start_mt( const Topology::Layout& layout ) {
+        std::size_t worker_index = 0;
+        for ( const Topology::Queue& queue : layout.queues ) {
+            TaskQueue& tasks = task_queues_.emplace_back( );
+            for ( const Topology::Thread& worker : queue.workers ) {
+                ThreadStats& stats = register_thread( std::format( "worker {}", worker_index++ ), worker );
+                thread_pool_.emplace_back( [ &tasks, &stats ] { worker_thread( tasks, stats ); } );
+            }
         }
-        task_cv_.notify_one( );
     }
 
     inline void start_mt( ) {
         // Create thread pool
-        for ( unsigned int i = 0; i < max_threads; ++i ) {
-            thread_pool_.emplace_back( &worker_thread );
-        }
+        start_mt( Topology::unpinned( 1, max_threads ) );
     }
 
     inline void end_mt( ) {
-        {
-            std::lock_guard<std::mutex> lock( task_mutex_ );
-            shutting_down_ = true;
-            task_cv_.notify_all( );
+        for ( TaskQueue& queue : task_queues_ ) {
+            std::lock_guard<std::mutex> lock( queue.mutex );
+            queue.shutting_down = true;
+            queue.cv.notify_all( );
         }
         for ( auto& t : thread_pool_ ) {
             if ( t.joinable( ) ) {
@@ -112,54 +212,113 @@ namespace Shared {
         thread_pool_.clear( );
     }
 
-    template <std::size_t N>
-    inline int receive_data( socket_t socket, char( &buffer )[ N ] ) {
-        // Ensure the buffer is large enough to hold data and a null terminator
-        static_assert( N > 1, "Buffer must be at least 2 bytes to allow space for null terminator" );
-
-		// Peek at the incoming data to check for HTTP requests or TLS ClientHello
+    // Check the start of the pending data for HTTP requests or a TLS ClientHello
+    inline bool is_http_request( const char* data, std::size_t size ) {
         char peek_buf[ 8 ] = {};
-        if ( const int peeked = recv( socket, peek_buf, sizeof( peek_buf ) - 1, MSG_PEEK );
-             peeked > 0 ) {
-            peek_buf[ peeked ] = '\0';  // ensure null-terminated for strstr/strncmp safety
-
-            // Check for TLS ClientHello (first byte 0x16 indicates a handshake record)
-            if ( static_cast< unsigned char >( peek_buf[ 0 ] ) == 0x16 )
-                return HTTP_DETECTED;
-
-            // Detect common HTTP methods or headers
-            constexpr static const std::string_view http_methods[ ] = { "GET", "POST", "HEAD", "PUT", "DELETE" };
-            for ( const auto& method : http_methods ) {
-				// Check if the peeked buffer is a known HTTP method
-                if ( strncmp( peek_buf, method.data( ), method.size( ) ) == 0 )
-                    return HTTP_DETECTED;
-            }
+        std::memcpy( peek_buf, data, std::min( size, sizeof( peek_buf ) - 1 ) );
+
+        // Check for TLS ClientHello (first byte 0x16 indicates a handshake record)
+        if ( static_cast< unsigned char >( peek_buf[ 0 ] ) == 0x16 )
+            return true;
 
-			// Check for HTTP version in the peeked buffer
-            if ( strstr( peek_buf, "HTTP/" ) != nullptr )
-                return HTTP_DETECTED;
+        // Detect common HTTP methods or headers
+        constexpr static const std::string_view http_methods[ ] = { "GET", "POST", "HEAD", "PUT", "DELETE" };
+        for ( const auto& method : http_methods ) {
+			// Check if the peeked buffer is a known HTTP method
+            if ( strncmp( peek_buf, method.data( ), method.size( ) ) == 0 )
+                return true;
         }
 
-        // Clear the buffer before receiving data
-        const int bytes_received = recv( socket, buffer, static_cast< int >( N - 1 ), 0 );
+		// Check for HTTP version in the peeked buffer
+        return strstr( peek_buf, "HTTP/" ) != nullptr;
+    }
+
+    // Read the next line from the socket into line (without the delimiter). Only bytes up to and including
+    // the delimiter are consumed, so a binary frame following the line stays in the socket.
+    // Returns the bytes consumed like recv, with complete set once line holds a whole line.
+    inline int receive_line( socket_t socket, std::string& line, bool& complete, bool detect_http = false ) {
+        complete = false;
+
+        // Peek at the pending data, one byte more than a full line so its delimiter fits
+        char peek_buf[ max_message_length + 1U ] = {};
+        const std::size_t wanted = std::max<std::size_t>( 1, sizeof( peek_buf ) - std::min( line.size( ), sizeof( peek_buf ) - 1 ) );
+        const int peeked = recv( socket, peek_buf, static_cast< int >( wanted ), MSG_PEEK );
+        if ( peeked <= 0 )
+            return peeked;
+
+        // Only the start of a line can be the start of a HTTP request
+        if ( detect_http && line.empty( ) && is_http_request( peek_buf, static_cast< std::size_t >( peeked ) ) )
+            return HTTP_DETECTED;
+
+        // Consume up to the delimiter or everything that was peeked if the line is not complete yet
+        const char* delimiter = static_cast< const char* >( std::memchr( peek_buf, line_delimiter, static_cast< std::size_t >( peeked ) ) );
+        const int length = delimiter != nullptr ? static_cast< int >( delimiter - peek_buf ) + 1 : peeked;
+        const int bytes_received = recv( socket, peek_buf, length, 0 );
         if ( bytes_received <= 0 )
             return bytes_received;
 
-        // Null-terminate the received data
-        buffer[ bytes_received ] = '\0';
-
-        // Discard any leftover data beyond buffer
-        if ( bytes_received == static_cast< int >( N - 1 ) ) {
-            char discard_buffer[ 128 ];
-            while ( true ) {
-				// Attempt to read more data to discard
-                const int extra_bytes = recv( socket, discard_buffer, sizeof( discard_buffer ), 0 );
-				// If no more data is available, break the loop
-                if ( extra_bytes <= 0 )
-                    break;
+        complete = delimiter != nullptr && bytes_received == length;
+        line.append( peek_buf, static_cast< std::size_t >( complete ? bytes_received - 1 : bytes_received ) );
+
+        if ( line.size( ) > static_cast< std::size_t >( max_message_length ) )
+            return LINE_TOO_LONG;
+        return bytes_received;
+    }
+
+    // Wait until the socket can be written to, false on timeout or error
+    inline bool wait_writable( socket_t socket, std::chrono::milliseconds timeout ) {
+        fd_set write_set = {};
+        FD_ZERO( &write_set );
+        FD_SET( socket, &write_set );
+
+        timeval tv = {};
+        tv.tv_sec = static_cast< long >( timeout.count( ) / 1000 );
+        tv.tv_usec = static_cast< long >( ( timeout.count( ) % 1000 ) * 1000 );
+        return select( static_cast< int >( socket ) + 1, nullptr, &write_set, nullptr, &tv ) > 0;
+    }
+
+    // Send all of data, waiting for non-blocking sockets to drain instead of dropping partial writes
+    inline bool send_all( socket_t socket, std::string_view data, std::chrono::milliseconds timeout = send_timeout ) {
+        while ( !data.empty( ) ) {
+            const int sent = send( socket, data.data( ), static_cast< int >( std::min<std::size_t>( data.size( ), INT_MAX ) ), SEND_FLAGS );
+            if ( sent < 0 ) {
+                const int err = GET_ERROR;
+                if ( err == EINTR_ERR )
+                    continue;
+                if ( err == WOULD_BLOCK && wait_writable( socket, timeout ) )
+                    continue;
+                return false;
             }
+            data.remove_prefix( static_cast< std::size_t >( sent ) );
         }
+        return true;
+    }
 
-        return bytes_received;
+    // Send text followed by the line delimiter
+    inline bool send_line( socket_t socket, std::string_view text ) {
+        std::string line = {};
+        line.reserve( text.size( ) + 1 );
+        line.append( text );
+        line.push_back( line_delimiter );
+        return send_all( socket, line );
+    }
+
+    // Split a protocol line into its tab separated fields
+    inline std::vector<std::string_view> split_fields( std::string_view text ) {
+        std::vector<std::string_view> fields = {};
+        while ( true ) {
+            const std::size_t separator = text.find( field_separator );
+            fields.push_back( text.substr( 0, separator ) );
+            if ( separator == std::string_view::npos )
+                return fields;
+            text.remove_prefix( separator + 1 );
+        }
+    }
+
+    // Parse a whole field as an unsigned number
+    template <typename T>
+    inline bool parse_number( std::string_view text, T& value ) {
+        const auto [ end, ec ] = std::from_chars( text.data( ), text.data( ) + text.size( ), value );
+        return ec == std::errc( ) && end == text.data( ) + text.size( );
     }
 }
\ No newline at end of file
@@ -0,0 +1,285 @@
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#elif defined( __linux__ )
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// CPU and NUMA node layout of the machine and pinning threads to it
+namespace Topology {
+    struct Node {
+        int id = 0;
+        std::vector<int> cpus = {};
+    };
+
+    // Where a thread runs, a cpu of -1 leaves it to the scheduler
+    struct Thread {
+        int cpu = -1;
+        int node = -1;
+        // Task queue an event loop hands its work to
+        std::size_t queue = 0;
+    };
+
+    // Workers sharing one task queue, one queue per NUMA node so tasks run next to the memory they touch
+    struct Queue {
+        int node = -1;
+        std::vector<Thread> workers = {};
+    };
+
+    struct Layout {
+        std::vector<Thread> event_loops = {};
+        std::vector<Queue> queues = {};
+    };
+
+    // Parse a Linux style CPU list like "0-3,8,10-11"
+    inline std::vector<int> parse_cpu_list( std::string_view text ) {
+        std::vector<int> cpus = {};
+        while ( !text.empty( ) ) {
+            const std::size_t comma = text.find( ',' );
+            const std::string_view range = text.substr( 0, comma );
+            text = comma == std::string_view::npos ? std::string_view( ) : text.substr( comma + 1 );
+
+            const std::size_t dash = range.find( '-' );
+            int first = 0, last = 0;
+            const std::string_view first_text = range.substr( 0, dash );
+            const std::string_view last_text = dash == std::string_view::npos ? first_text : range.substr( dash + 1 );
+            if ( std::from_chars( first_text.data( ), first_text.data( ) + first_text.size( ), first ).ec != std::errc( ) ||
+                 std::from_chars( last_text.data( ), last_text.data( ) + last_text.size( ), last ).ec != std::errc( ) )
+                continue;
+            for ( int cpu = first; cpu <= last; ++cpu )
+                cpus.push_back( cpu );
+        }
+        return cpus;
+    }
+
+    // Inverse of parse_cpu_list, used for the startup report
+    inline std::string format_cpu_list( std::vector<int> cpus ) {
+        std::sort( cpus.begin( ), cpus.end( ) );
+        cpus.erase( std::unique( cpus.begin( ), cpus.end( ) ), cpus.end( ) );
+
+        std::string text = {};
+        for ( std::size_t i = 0; i < cpus.size( ); ) {
+            std::size_t j = i;
+            while ( j + 1 < cpus.size( ) && cpus[ j + 1 ] == cpus[ j ] + 1 )
+                ++j;
+            text.append( text.empty( ) ? "" : "," ).append( j == i ? std::to_string( cpus[ i ] ) : std::format( "{}-{}", cpus[ i ], cpus[ j ] ) );
+            i = j + 1;
+        }
+        return text;
+    }
+
+    // NUMA nodes with the CPUs this process is allowed to run on, a single node when the OS does not tell
+    inline std::vector<Node> detect( ) {
+        std::vector<Node> nodes = {};
+#ifdef __linux__
+        // Respect taskset and cgroup cpusets
+        cpu_set_t allowed = {};
+        CPU_ZERO( &allowed );
+        const bool have_affinity = sched_getaffinity( 0, sizeof( allowed ), &allowed ) == 0;
+        const auto is_allowed = [ & ]( int cpu ) { return !have_affinity || ( cpu < CPU_SETSIZE && CPU_ISSET( cpu, &allowed ) ); };
+
+        std::error_code error = {};
+        for ( const auto& entry : std::filesystem::directory_iterator( "/sys/devices/system/node", error ) ) {
+            const std::string name = entry.path( ).filename( ).string( );
+            Node node = {};
+            if ( !name.starts_with( "node" ) || std::from_chars( name.data( ) + 4, name.data( ) + name.size( ), node.id ).ec != std::errc( ) )
+                continue;
+
+            std::ifstream file( entry.path( ) / "cpulist" );
+            std::string list = {};
+            std::getline( file, list );
+            for ( const int cpu : parse_cpu_list( list ) ) {
+                if ( is_allowed( cpu ) )
+                    node.cpus.push_back( cpu );
+            }
+            if ( !node.cpus.empty( ) )
+                nodes.push_back( std::move( node ) );
+        }
+
+        if ( nodes.empty( ) && have_affinity ) {
+            Node node = {};
+            for ( int cpu = 0; cpu < CPU_SETSIZE; ++cpu ) {
+                if ( CPU_ISSET( cpu, &allowed ) )
+                    node.cpus.push_back( cpu );
+            }
+            nodes.push_back( std::move( node ) );
+        }
+#elif defined( _WIN32 )
+        ULONG highest = 0;
+        if ( GetNumaHighestNodeNumber( &highest ) ) {
+            for ( ULONG id = 0; id <= highest; ++id ) {
+                GROUP_AFFINITY affinity = {};
+                if ( !GetNumaNodeProcessorMaskEx( static_cast< USHORT >( id ), &affinity ) )
+                    continue;
+
+                // CPUs are numbered across processor groups of 64
+                Node node = {};
+                node.id = static_cast< int >( id );
+                for ( int bit = 0; bit < 64; ++bit ) {
+                    if ( affinity.Mask & ( KAFFINITY( 1 ) << bit ) )
+                        node.cpus.push_back( affinity.Group * 64 + bit );
+                }
+                if ( !node.cpus.empty( ) )
+                    nodes.push_back( std::move( node ) );
+            }
+        }
+#endif
+        if ( nodes.empty( ) ) {
+            Node node = {};
+            for ( unsigned int cpu = 0; cpu < std::max( 1u, std::thread::hardware_concurrency( ) ); ++cpu )
+                node.cpus.push_back( static_cast< int >( cpu ) );
+            nodes.push_back( std::move( node ) );
+        }
+
+        std::sort( nodes.begin( ), nodes.end( ), [ ]( const Node& a, const Node& b ) { return a.id < b.id; } );
+        return nodes;
+    }
+
+    // Pin the calling thread to cpu and keep its allocations on that CPUs node. Call it first thing in a new
+    // thread so its stack and everything it allocates is touched, and therefore placed, on the right node.
+    inline bool pin_current_thread( int cpu ) {
+        if ( cpu < 0 )
+            return false;
+#ifdef __linux__
+        cpu_set_t set = {};
+        CPU_ZERO( &set );
+        CPU_SET( cpu, &set );
+        if ( sched_setaffinity( 0, sizeof( set ), &set ) != 0 )
+            return false;
+#ifdef SYS_set_mempolicy
+        // MPOL_LOCAL, allocate on the node the thread runs on even if the process was started with another policy
+        constexpr static const int local_policy = 4;
+        syscall( SYS_set_mempolicy, local_policy, nullptr, 0 );
+#endif
+        return true;
+#elif defined( _WIN32 )
+        // Windows already prefers memory from the node of the processor a thread runs on
+        GROUP_AFFINITY affinity = {};
+        affinity.Group = static_cast< WORD >( cpu / 64 );
+        affinity.Mask = KAFFINITY( 1 ) << ( cpu % 64 );
+        return SetThreadGroupAffinity( GetCurrentThread( ), &affinity, nullptr ) != 0;
+#else
+        return false;
+#endif
+    }
+
+    // Layout without pinning, a single queue served by the given number of workers
+    inline Layout unpinned( unsigned int event_loops, unsigned int workers ) {
+        Layout layout = {};
+        layout.event_loops.assign( std::max( 1u, event_loops ), Thread{ } );
+        layout.queues.push_back( Queue{ -1, std::vector<Thread>( std::max( 1u, workers ), Thread{ } ) } );
+        return layout;
+    }
+
+    // Spread the event loops over the nodes on CPUs of their own, then give the workers the remaining CPUs.
+    // A worker count of 0 means one worker per remaining CPU.
+    inline Layout plan( const std::vector<Node>& nodes, unsigned int event_loops, unsigned int workers ) {
+        event_loops = std::max( 1u, event_loops );
+
+        Layout layout = {};
+        std::vector<std::vector<int>> free = {};
+        for ( const Node& node : nodes ) {
+            free.push_back( node.cpus );
+            layout.queues.push_back( Queue{ node.id, { } } );
+        }
+
+        // Event loops go round robin over the nodes, sharing CPUs once a node has none left
+        for ( unsigned int i = 0; i < event_loops; ++i ) {
+            const std::size_t index = i % nodes.size( );
+            Thread loop = {};
+            loop.node = nodes[ index ].id;
+            loop.queue = index;
+            if ( !free[ index ].empty( ) ) {
+                loop.cpu = free[ index ].front( );
+                free[ index ].erase( free[ index ].begin( ) );
+            }
+            else
+                loop.cpu = nodes[ index ].cpus[ ( i / nodes.size( ) ) % nodes[ index ].cpus.size( ) ];
+            layout.event_loops.push_back( loop );
+        }
+
+        // Interleave the remaining CPUs of all nodes so any worker count is spread evenly,
+        // with more workers than CPUs (or no CPU left at all) they double up from the start
+        std::vector<std::pair<int, std::size_t>> order = {};
+        for ( std::size_t round = 0, added = 1; added > 0; ++round ) {
+            added = 0;
+            for ( std::size_t index = 0; index < free.size( ); ++index ) {
+                if ( round < free[ index ].size( ) ) {
+                    order.emplace_back( free[ index ][ round ], index );
+                    ++added;
+                }
+            }
+        }
+        if ( order.empty( ) ) {
+            for ( std::size_t index = 0; index < nodes.size( ); ++index ) {
+                for ( const int cpu : nodes[ index ].cpus )
+                    order.emplace_back( cpu, index );
+            }
+        }
+
+        const std::size_t worker_count = workers > 0 ? workers : std::max<std::size_t>( 1, order.size( ) );
+        for ( std::size_t i = 0; i < worker_count; ++i ) {
+            const auto [ cpu, index ] = order[ i % order.size( ) ];
+            layout.queues[ index ].workers.push_back( Thread{ cpu, nodes[ index ].id, index } );
+        }
+
+        // Drop queues without workers, event loops on such a node hand their tasks to the first remaining queue
+        std::vector<std::size_t> remap( layout.queues.size( ), 0 );
+        std::vector<Queue> queues = {};
+        for ( std::size_t index = 0; index < layout.queues.size( ); ++index ) {
+            if ( layout.queues[ index ].workers.empty( ) )
+                continue;
+            remap[ index ] = queues.size( );
+            for ( Thread& worker : layout.queues[ index ].workers )
+                worker.queue = queues.size( );
+            queues.push_back( std::move( layout.queues[ index ] ) );
+        }
+        for ( Thread& loop : layout.event_loops )
+            loop.queue = remap[ loop.queue ];
+        layout.queues = std::move( queues );
+        return layout;
+    }
+
+    // Human readable summary of the machine and the chosen layout
+    inline std::string describe( const std::vector<Node>& nodes, const Layout& layout ) {
+        std::size_t cpus = 0;
+        for ( const Node& node : nodes )
+            cpus += node.cpus.size( );
+
+        std::string text = std::format( "Topology: {} NUMA node{}, {} CPUs\n", nodes.size( ), nodes.size( ) == 1 ? "" : "s", cpus );
+        for ( const Node& node : nodes )
+            text.append( std::format( "  node {}: cpus {}\n", node.id, format_cpu_list( node.cpus ) ) );
+
+        const auto where = [ ]( const Thread& thread ) {
+            return thread.cpu < 0 ? std::string( "unpinned" ) : std::format( "on cpu {} (node {})", thread.cpu, thread.node );
+        };
+
+        text.append( "Layout:\n" );
+        for ( std::size_t i = 0; i < layout.event_loops.size( ); ++i )
+            text.append( std::format( "  event loop {} {}, tasks to queue {}\n", i, where( layout.event_loops[ i ] ), layout.event_loops[ i ].queue ) );
+        for ( std::size_t i = 0; i < layout.queues.size( ); ++i ) {
+            const Queue& queue = layout.queues[ i ];
+            std::vector<int> worker_cpus = {};
+            for ( const Thread& worker : queue.workers ) {
+                if ( worker.cpu >= 0 )
+                    worker_cpus.push_back( worker.cpu );
+            }
+            text.append( std::format( "  queue {}: {} worker{} {}\n", i, queue.workers.size( ), queue.workers.size( ) == 1 ? "" : "s",
+                                      worker_cpus.empty( ) ? std::string( "unpinned" ) : std::format( "on cpus {} (node {})", format_cpu_list( worker_cpus ), queue.node ) ) );
+        }
+        return text;
+    }
+}
@@ -0,0 +1,154 @@
+#pragma once
+#include "Shared.hpp"
+
+#include <fstream>
+#include <iterator>
+#include <string>
+
+// Binary trace of the traffic a server received, written by the server and played back by the replay tool.
+// After the magic every record is a kind byte followed by varints: microseconds since the previous record,
+// the connection id and, for lines and data, the length. Only lines carry their bytes, data is just a length.
+namespace Trace {
+    constexpr static const std::string_view magic = "CHATTRC1";
+    // Records are written to disk in batches of about this size
+    constexpr static const std::size_t flush_threshold = 256 * 1024;
+
+    enum class EventKind : std::uint8_t {
+        Connect,        // A client connected
+        Line,           // A complete line the client sent, without its delimiter
+        Data,           // File payload bytes the client sent
+        Disconnect      // The connection was closed by either side
+    };
+
+    struct Event {
+        EventKind kind = EventKind::Connect;
+        // Microseconds since the trace started
+        std::uint64_t time = 0;
+        std::uint64_t connection = 0;
+        // Line contents, empty for every other kind
+        std::string line = {};
+        // Byte count of a data event
+        std::uint64_t length = 0;
+    };
+
+    // LEB128 encoding, small values take a single byte
+    inline void put_varint( std::string& out, std::uint64_t value ) {
+        while ( value >= 0x80 ) {
+            out.push_back( static_cast< char >( ( value & 0x7F ) | 0x80 ) );
+            value >>= 7;
+        }
+        out.push_back( static_cast< char >( value ) );
+    }
+
+    inline bool get_varint( std::string_view& in, std::uint64_t& value ) {
+        value = 0;
+        for ( int shift = 0; shift < 64 && !in.empty( ); shift += 7 ) {
+            const auto byte = static_cast< unsigned char >( in.front( ) );
+            in.remove_prefix( 1 );
+            value |= static_cast< std::uint64_t >( byte & 0x7F ) << shift;
+            if ( ( byte & 0x80 ) == 0 )
+                return true;
+        }
+        return false;
+    }
+
+    // Appends records from any thread, they are buffered and written out in large batches
+    class Writer {
+    private:
+        using clock = std::chrono::steady_clock;
+
+        std::ofstream file_ = {};
+        std::string buffer_ = {};
+        std::mutex mutex_ = {};
+        clock::time_point start_ = clock::now( );
+        std::uint64_t last_time_ = 0;
+    public:
+        explicit Writer( const std::string& path ) : file_( path, std::ios::binary | std::ios::trunc ) {
+            if ( !file_ )
+                throw std::runtime_error( std::format( "Could not open trace file {}", path ) );
+            buffer_.reserve( flush_threshold + max_message_length + 32 );
+            buffer_.append( magic );
+        }
+
+        ~Writer( ) {
+            flush( );
+        }
+
+        Writer( const Writer& ) = delete;
+        Writer& operator=( const Writer& ) = delete;
+
+        void record( EventKind kind, std::uint64_t connection, std::string_view line = {}, std::uint64_t length = 0 ) {
+            std::lock_guard<std::mutex> lock( mutex_ );
+
+            // Timestamps are taken under the lock so the deltas never go negative
+            const auto time = static_cast< std::uint64_t >( std::chrono::duration_cast< std::chrono::microseconds >( clock::now( ) - start_ ).count( ) );
+            buffer_.push_back( static_cast< char >( kind ) );
+            put_varint( buffer_, time - last_time_ );
+            put_varint( buffer_, connection );
+            last_time_ = time;
+
+            if ( kind == EventKind::Line ) {
+                put_varint( buffer_, line.size( ) );
+                buffer_.append( line );
+            }
+            else if ( kind == EventKind::Data )
+                put_varint( buffer_, length );
+
+            if ( buffer_.size( ) >= flush_threshold )
+                write_buffer( );
+        }
+
+        // Write out whatever is buffered, called periodically so a crash loses little of the trace
+        void flush( ) {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            if ( !buffer_.empty( ) )
+                write_buffer( );
+            file_.flush( );
+        }
+    private:
+        void write_buffer( ) {
+            file_.write( buffer_.data( ), static_cast< std::streamsize >( buffer_.size( ) ) );
+            buffer_.clear( );
+        }
+    };
+
+    // Load a whole trace, throws if the file is missing or malformed
+    inline std::vector<Event> read( const std::string& path ) {
+        std::ifstream file( path, std::ios::binary );
+        if ( !file )
+            throw std::runtime_error( std::format( "Could not open trace file {}", path ) );
+        const std::string contents( ( std::istreambuf_iterator<char>( file ) ), std::istreambuf_iterator<char>( ) );
+
+        std::string_view in = contents;
+        if ( !in.starts_with( magic ) )
+            throw std::runtime_error( std::format( "{} is not a trace file", path ) );
+        in.remove_prefix( magic.size( ) );
+
+        std::vector<Event> events = {};
+        std::uint64_t time = 0;
+        while ( !in.empty( ) ) {
+            Event event = {};
+            event.kind = static_cast< EventKind >( in.front( ) );
+            in.remove_prefix( 1 );
+
+            std::uint64_t delta = 0;
+            if ( event.kind > EventKind::Disconnect || !get_varint( in, delta ) || !get_varint( in, event.connection ) )
+                throw std::runtime_error( std::format( "Corrupt record {} in {}", events.size( ), path ) );
+            time += delta;
+            event.time = time;
+
+            if ( event.kind == EventKind::Line ) {
+                std::uint64_t size = 0;
+                if ( !get_varint( in, size ) || size > in.size( ) )
+                    throw std::runtime_error( std::format( "Corrupt record {} in {}", events.size( ), path ) );
+                event.line.assign( in.substr( 0, static_cast< std::size_t >( size ) ) );
+                in.remove_prefix( static_cast< std::size_t >( size ) );
+            }
+            else if ( event.kind == EventKind::Data && !get_varint( in, event.length ) )
+                throw std::runtime_error( std::format( "Corrupt record {} in {}", events.size( ), path ) );
+
+            events.push_back( std::move( event ) );
+        }
+        return events;
+    }
+}